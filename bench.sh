@@ -0,0 +1,207 @@
+#!/bin/bash
+#
+# Orvibo - A simple home web server for control of Orvibo WiFi plugs.
+#
+# Copyright 2023, Pascal Martin
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor,
+# Boston, MA  02110-1301, USA.
+#
+#
+# bench.sh - End-to-end benchmark of the orvibo service.
+#
+# This script runs the orvibo service against emulated fleets of plugs
+# (see orviboemu.c) and measures, for each fleet size:
+#
+# - the time until all plugs have been discovered,
+# - the /orvibo/set throughput, in commands per second,
+# - the latency from a command to all plugs reporting the new state,
+# - the /orvibo/status throughput, in requests per second, and its size,
+# - the CPU time and peak memory (RSS) used by the service.
+#
+# The results are appended to $BENCH_OUTPUT, one JSON object per line.
+# The following environment variables can be used to change the setup:
+#
+# BENCH_SIZES     The fleet sizes to test (default: "10 100 1000 10000").
+# BENCH_UDP       The UDP port of the emulator (default: 10100). The
+#                 service uses the next port.
+# BENCH_HTTP      The HTTP port of the service (default: 10180).
+# BENCH_LATENCY   The emulator's reply latency in ms (default: 0).
+# BENCH_LOSS      The emulator's packet loss in percent (default: 0).
+# BENCH_REQUESTS  The number of HTTP requests per test (default: 1000).
+# BENCH_TIMEOUT   How long to wait for discovery or convergence, in
+#                 seconds (default: 120).
+# BENCH_OUTPUT    The result file (default: bench.json).
+
+BENCH_SIZES=${BENCH_SIZES:-"10 100 1000 10000"}
+BENCH_UDP=${BENCH_UDP:-10100}
+BENCH_HTTP=${BENCH_HTTP:-10180}
+BENCH_LATENCY=${BENCH_LATENCY:-0}
+BENCH_LOSS=${BENCH_LOSS:-0}
+BENCH_REQUESTS=${BENCH_REQUESTS:-1000}
+BENCH_TIMEOUT=${BENCH_TIMEOUT:-120}
+BENCH_OUTPUT=${BENCH_OUTPUT:-bench.json}
+
+WORK=$(mktemp -d /tmp/orvibo-bench.XXXXXX)
+URL=http://127.0.0.1:$BENCH_HTTP/orvibo
+EMUPID=
+SVCPID=
+
+cleanup () {
+    [ -n "$SVCPID" ] && kill $SVCPID 2>/dev/null
+    [ -n "$EMUPID" ] && kill $EMUPID 2>/dev/null
+    wait 2>/dev/null
+    SVCPID=
+    EMUPID=
+}
+trap 'cleanup; rm -rf $WORK; exit 1' INT TERM
+
+now_ms () {
+    date +%s%3N
+}
+
+# Generate a configuration that matches the emulated MAC addresses.
+#
+configure () {
+    local count=$1
+    local i
+    {
+        echo '{"orvibo":{"plugs":['
+        for ((i = 0; i < count; ++i)) ; do
+            [ $i -gt 0 ] && echo ','
+            printf '{"name":"bench%d","address":"ACCF23%06X","description":"emulated"}' $i $i
+        done
+        echo ']}}'
+    } > $WORK/orvibo.json
+}
+
+# Count the plugs reported in the specified state.
+#
+count_state () {
+    curl -s "$URL/status" | grep -Eo "\"state\" *: *\"$1\"" | wc -l
+}
+
+# Count the plugs that have not yet reached the commanded state.
+#
+count_pending () {
+    curl -s "$URL/status" | grep -Eo '"command" *:' | wc -l
+}
+
+# Wait until the condition returns the expected value. Print the time
+# elapsed in ms, or -1 on timeout.
+#
+wait_for () {
+    local expected=$1
+    shift
+    local start=$(now_ms)
+    local deadline=$((start + (BENCH_TIMEOUT * 1000)))
+    while [ $(now_ms) -lt $deadline ] ; do
+        if [ "$("$@")" -eq "$expected" ] ; then
+            echo $(($(now_ms) - start))
+            return
+        fi
+        sleep 0.05
+    done
+    echo -1
+}
+
+# Run a list of requests through a single curl process (keep-alive).
+# Print the elapsed time in ms, and the total number of bytes received.
+#
+run_requests () {
+    local list=$1
+    local start=$(now_ms)
+    local bytes=$(curl -s -w '%{size_download}\n' -K $list | awk '{s+=$1} END {print s+0}')
+    echo "$(($(now_ms) - start)) $bytes"
+}
+
+# Return the CPU time (ms) and peak RSS (kB) of the service.
+#
+service_usage () {
+    local ticks=$(awk '{print $14 + $15}' /proc/$SVCPID/stat)
+    local hz=$(getconf CLK_TCK)
+    local rss=$(awk '/VmHWM/ {print $2}' /proc/$SVCPID/status)
+    echo "$((ticks * 1000 / hz)) $rss"
+}
+
+bench () {
+    local count=$1
+
+    configure $count
+
+    ./orviboemu -plugs=$count -address=127.0.0.1 -port=$BENCH_UDP \
+                -latency=$BENCH_LATENCY -loss=$BENCH_LOSS > $WORK/emu.log &
+    EMUPID=$!
+    sleep 0.2
+
+    ./orvibo -http-service=$BENCH_HTTP -config=$WORK/orvibo.json \
+             -orvibo-port=$((BENCH_UDP + 1)) \
+             -orvibo-discovery=127.0.0.1:$BENCH_UDP > $WORK/orvibo.log 2>&1 &
+    SVCPID=$!
+
+    # Wait for the service to answer, then for the whole fleet.
+    #
+    local ready=$(wait_for 1 sh -c "curl -s -o /dev/null $URL/status && echo 1 || echo 0")
+    if [ $ready -lt 0 ] ; then
+        echo "** orvibo did not start (see $WORK/orvibo.log)" >&2
+        cleanup
+        return 1
+    fi
+    local discovery=$(wait_for $count count_state off)
+
+    # Command throughput: sequential requests over one connection,
+    # cycling through all plugs.
+    #
+    local i
+    for ((i = 0; i < BENCH_REQUESTS; ++i)) ; do
+        echo "url = \"$URL/set?point=bench$((i % count))&state=off\""
+        echo "output = \"/dev/null\""
+    done > $WORK/set.list
+    local set=($(run_requests $WORK/set.list))
+
+    # Convergence: switch the whole fleet on, wait until every plug
+    # reports the new state.
+    #
+    curl -s -o /dev/null "$URL/set?point=all&state=on"
+    local converged=$(wait_for 0 count_pending)
+
+    for ((i = 0; i < BENCH_REQUESTS; ++i)) ; do
+        echo "url = \"$URL/status\""
+        echo "output = \"/dev/null\""
+    done > $WORK/status.list
+    local status=($(run_requests $WORK/status.list))
+
+    local usage=($(service_usage))
+    cleanup
+
+    local setrate=0
+    local statusrate=0
+    [ ${set[0]} -gt 0 ] && setrate=$((BENCH_REQUESTS * 1000 / set[0]))
+    [ ${status[0]} -gt 0 ] && statusrate=$((BENCH_REQUESTS * 1000 / status[0]))
+
+    printf '{"date":"%s","version":"%s","plugs":%d,"latency":%d,"loss":%d,' \
+           "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(git describe --always --dirty 2>/dev/null)" \
+           $count $BENCH_LATENCY $BENCH_LOSS
+    printf '"discovery_ms":%d,"set_per_s":%d,"converge_ms":%d,' \
+           $discovery $setrate $converged
+    printf '"status_per_s":%d,"status_bytes":%d,"cpu_ms":%d,"rss_kb":%d}\n' \
+           $statusrate $((status[1] / BENCH_REQUESTS)) ${usage[0]} ${usage[1]}
+}
+
+for size in $BENCH_SIZES ; do
+    echo "Benchmark with $size plugs.." >&2
+    bench $size | tee -a $BENCH_OUTPUT
+done
+rm -rf $WORK
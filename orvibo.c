@@ -29,11 +29,13 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
+#include <netinet/in.h>
 
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fnmatch.h>
 
 #include "echttp.h"
 #include "echttp_cors.h"
@@ -47,38 +49,91 @@
 #include "housedepositor.h"
 
 #include "orvibo_plug.h"
+#include "orvibo_metrics.h"
+#include "orvibo_scene.h"
+#include "orvibo_pacer.h"
+#include "orvibo_event.h"
+#include "orvibo_interface.h"
+#include "orvibo_ingest.h"
 
 static int LiveState = 0;
 
 static char HostName[256];
 
-static const char *orvibo_status (const char *method, const char *uri,
-                                  const char *data, int length) {
+// The status document is cached, and rebuilt only when the live state
+// version changed. The ETag combines the service start time with that
+// version, so that it does not match a document from a previous run.
+//
+static char *StatusBuffer = 0;
+static int  StatusSize = 0;
+static int  StatusVersion = -1;
+static char StatusTag[64];
+static time_t StatusEpoch = 0;
+
+// The JSON rendering buffers grow with the number of plugs.
+//
+static ParserToken *RenderToken = 0;
+static int RenderTokenCount = 0;
+static char *RenderPool = 0;
+static char *RenderBuffer = 0;
+static int RenderSize = 0;
+
+static int orvibo_status_space (int count) {
+
+    int tokens = 320 + (6 * count);   // Includes the removed plugs.
+    int size = 16384 + (256 * count);
+
+    if (tokens > RenderTokenCount) {
+        ParserToken *token = realloc (RenderToken, tokens * sizeof(ParserToken));
+        if (!token) return 0;
+        RenderToken = token;
+        RenderTokenCount = tokens;
+    }
+    if (size > RenderSize) {
+        char *pool = realloc (RenderPool, size);
+        if (!pool) return 0;
+        RenderPool = pool;
+        char *buffer = realloc (RenderBuffer, size);
+        if (!buffer) return 0;
+        RenderBuffer = buffer;
+        RenderSize = size;
+    }
+    return 1;
+}
 
-    if (housestate_same (LiveState)) return "";
+// Render the status of the plugs that changed after the specified
+// version, or of all plugs if since is negative. A delta document
+// also lists the plugs removed after that version. The result is
+// valid until the next call, or 0 on error.
+//
+static const char *orvibo_status_render (int since) {
 
-    static char buffer[65537];
-    ParserToken token[1024];
-    char pool[65537];
-    char host[256];
     int count = orvibo_plug_count();
     int i;
+    long long start = orvibo_metrics_clock ();
 
-    gethostname (host, sizeof(host));
-
-    ParserContext context = echttp_json_start (token, 1024, pool, 65537);
+    if (!orvibo_status_space (count)) {
+        houselog_trace (HOUSE_FAILURE, "STATUS", "no more memory");
+        return 0;
+    }
+    ParserContext context = echttp_json_start (RenderToken, RenderTokenCount,
+                                               RenderPool, RenderSize);
 
     int root = echttp_json_add_object (context, 0, 0);
-    echttp_json_add_string (context, root, "host", host);
+    echttp_json_add_string (context, root, "host", HostName);
     echttp_json_add_string (context, root, "proxy", houseportal_server());
     echttp_json_add_integer (context, root, "timestamp", (long)time(0));
     echttp_json_add_integer (context, root, "latest", housestate_current(LiveState));
+    if (since >= 0)
+        echttp_json_add_integer (context, root, "since", since);
     int top = echttp_json_add_object (context, root, "control");
     int container = echttp_json_add_object (context, top, "status");
 
     for (i = 0; i < count; ++i) {
-        time_t pulsed = orvibo_plug_deadline(i);
+        if (since >= 0 && orvibo_plug_version(i) <= since) continue;
         const char *name = orvibo_plug_name(i);
+        if (!name[0]) continue; // Free slot.
+        time_t pulsed = orvibo_plug_deadline(i);
         const char *status = orvibo_plug_failure(i);
         if (!status) status = orvibo_plug_get(i)?"on":"off";
         const char *commanded = orvibo_plug_commanded(i)?"on":"off";
@@ -91,13 +146,320 @@ static const char *orvibo_status (const char *method, const char *uri,
             echttp_json_add_integer (context, point, "pulse", (int)pulsed);
         echttp_json_add_string (context, point, "gear", "light");
     }
-    const char *error = echttp_json_export (context, buffer, 65537);
+    if (since >= 0) {
+        int cursor = 0;
+        int removed = echttp_json_add_array (context, top, "removed");
+        const char *name;
+        while ((name = orvibo_plug_removed (since, &cursor)) != 0)
+            echttp_json_add_string (context, removed, 0, name);
+    }
+    const char *error = echttp_json_export (context, RenderBuffer, RenderSize);
+    if (error) {
+        houselog_trace (HOUSE_FAILURE, "STATUS", "%s", error);
+        return 0;
+    }
+    orvibo_metrics_record (ORVIBO_HIST_RENDER_US,
+                           orvibo_metrics_clock () - start);
+    orvibo_metrics_record (ORVIBO_HIST_RENDER_BYTES, strlen (RenderBuffer));
+    return RenderBuffer;
+}
+
+static const char *orvibo_status (const char *method, const char *uri,
+                                  const char *data, int length) {
+
+    orvibo_metrics_add (ORVIBO_HTTP_STATUS, 1);
+    if (housestate_same (LiveState)) {
+        orvibo_metrics_add (ORVIBO_HTTP_NOTMODIFIED, 1);
+        return "";
+    }
+
+    // Delta mode: only return what changed since the client's version,
+    // unless that version is too old for the changes to be known, or
+    // comes from a previous run. Nothing is rendered when nothing changed,
+    // so that polling costs little.
+    //
+    const char *sincep = echttp_parameter_get ("since");
+    if (sincep) {
+        int since = atoi(sincep);
+        int latest = housestate_current (LiveState);
+        if (since == latest) {
+            orvibo_metrics_add (ORVIBO_HTTP_NOTMODIFIED, 1);
+            echttp_error (304, "Not Modified");
+            return "";
+        }
+        if (since >= orvibo_plug_horizon() && since < latest) {
+            const char *delta = orvibo_status_render (since);
+            if (!delta) {
+                echttp_error (500, "cannot render the status");
+                return "";
+            }
+            echttp_content_type_json ();
+            return delta;
+        }
+    }
+
+    int version = housestate_current (LiveState);
+    if (version != StatusVersion) {
+        StatusVersion = -1;
+        const char *status = orvibo_status_render (-1);
+        if (!status) {
+            echttp_error (500, "cannot render the status");
+            return "";
+        }
+        int length = strlen(status) + 1;
+        if (length > StatusSize) {
+            char *buffer = realloc (StatusBuffer, length);
+            if (!buffer) {
+                echttp_error (500, "no more memory");
+                return "";
+            }
+            StatusBuffer = buffer;
+            StatusSize = length;
+        }
+        memcpy (StatusBuffer, status, length);
+        StatusVersion = version;
+        snprintf (StatusTag, sizeof(StatusTag),
+                  "\"%lx-%x\"", (long)StatusEpoch, version);
+    }
+    echttp_attribute_set ("ETag", StatusTag);
+    echttp_attribute_set ("Cache-Control", "no-cache"); // Always revalidate.
+
+    const char *match = echttp_attribute_get ("If-None-Match");
+    if (match && strstr (match, StatusTag)) {
+        orvibo_metrics_add (ORVIBO_HTTP_NOTMODIFIED, 1);
+        echttp_error (304, "Not Modified");
+        return "";
+    }
+    echttp_content_type_json ();
+    return StatusBuffer;
+}
+
+// A point name may be a plug name, a group name, a glob pattern (e.g.
+// "kitchen*" to select all the plugs whose name starts with "kitchen"),
+// or "all".
+//
+static int orvibo_set_isglob (const char *point) {
+    return (strcmp (point, "all") == 0) || (strpbrk (point, "*?[") != 0);
+}
+
+static int orvibo_set_match (const char *point, int i) {
+    const char *name = orvibo_plug_name(i);
+    if (!name[0]) return 0; // Free slot.
+    if (strcmp (point, "all") == 0) return 1;
+    return fnmatch (point, name, 0) == 0;
+}
+
+static int orvibo_set_grow (void **buffer, int *size, int needed, int unit) {
+    if (needed <= *size) return 1;
+    void *grown = realloc (*buffer, needed * unit);
+    if (!grown) {
+        echttp_error (500, "no more memory");
+        return 0;
+    }
+    *buffer = grown;
+    *size = needed;
+    return 1;
+}
+
+static int orvibo_set_state (const ParserToken *token) {
+    switch (token->type) {
+        case PARSER_BOOL: return token->value.bool ? 1 : 0;
+        case PARSER_INTEGER:
+            if (token->value.integer == 0 || token->value.integer == 1)
+                return (int)token->value.integer;
+            break;
+        case PARSER_STRING:
+            if (strcmp (token->value.string, "on") == 0) return 1;
+            if (strcmp (token->value.string, "off") == 0) return 0;
+            break;
+    }
+    return -1;
+}
+
+// Execute a list of commands, provided as a JSON array of objects with
+// a point name (or pattern), a state and an optional pulse. All points
+// are resolved first, so that each plug gets only the last command that
+// applies to it, then all frames are sent together. The response has
+// one entry per point, in the request order, with the number of plugs
+// that the point matched and the number of plugs that were set by it.
+//
+static const char *orvibo_set_batch (const char *data, int length) {
+
+    struct SetItem {
+        const char *point;
+        int state;
+        int pulse;
+        int matched;
+        int applied;
+        int errors;
+    };
+
+    static char *Text = 0;
+    static int TextSize = 0;
+    static ParserToken *Token = 0;
+    static int TokenSize = 0;
+    static struct SetItem *Items = 0;
+    static int ItemsSize = 0;
+    static int *Index = 0;
+    static int IndexSize = 0;
+    static int *Choice = 0;
+    static int ChoiceSize = 0;
+
+    int count = orvibo_plug_count();
+    int i, j;
+
+    if (!orvibo_set_grow ((void **)&Text, &TextSize, length + 1, 1)) return "";
+    memcpy (Text, data, length);
+    Text[length] = 0;
+
+    int tokens = echttp_json_estimate (Text);
+    if (!orvibo_set_grow ((void **)&Token, &TokenSize,
+                          tokens, sizeof(ParserToken))) return "";
+    const char *error = echttp_json_parse (Text, Token, &tokens);
+    if (error) {
+        echttp_error (400, error);
+        return "";
+    }
+    if (Token[0].type != PARSER_ARRAY) {
+        echttp_error (400, "expected an array of points");
+        return "";
+    }
+
+    int itemcount = Token[0].length;
+    if (!orvibo_set_grow ((void **)&Items, &ItemsSize,
+                          itemcount, sizeof(struct SetItem))) return "";
+    if (!orvibo_set_grow ((void **)&Index, &IndexSize,
+                          itemcount, sizeof(int))) return "";
+    if (!orvibo_set_grow ((void **)&Choice, &ChoiceSize,
+                          count, sizeof(int))) return "";
+    error = echttp_json_enumerate (Token, Index, itemcount);
+    if (error) {
+        echttp_error (400, error);
+        return "";
+    }
+
+    // Decode and validate all the items before changing anything.
+    //
+    for (i = 0; i < itemcount; ++i) {
+        const ParserToken *item = Token + Index[i];
+        if (item->type != PARSER_OBJECT) {
+            echttp_error (400, "invalid point entry");
+            return "";
+        }
+        int point = echttp_json_search (item, ".point");
+        int state = echttp_json_search (item, ".state");
+        int pulse = echttp_json_search (item, ".pulse");
+        if (point < 0 || item[point].type != PARSER_STRING) {
+            echttp_error (400, "missing point name");
+            return "";
+        }
+        if (state < 0 || orvibo_set_state (item + state) < 0) {
+            echttp_error (400, "invalid state value");
+            return "";
+        }
+        Items[i].point = item[point].value.string;
+        Items[i].state = orvibo_set_state (item + state);
+        Items[i].pulse = 0;
+        if (pulse >= 0) {
+            if (item[pulse].type != PARSER_INTEGER ||
+                item[pulse].value.integer < 0) {
+                echttp_error (400, "invalid pulse value");
+                return "";
+            }
+            Items[i].pulse = (int)item[pulse].value.integer;
+        }
+        Items[i].matched = 0;
+        Items[i].applied = 0;
+        Items[i].errors = 0;
+    }
+
+    // Resolve all the points: the exact names through the name index,
+    // then the patterns in one pass over the plugs.
+    //
+    int globs = 0;
+    for (i = 0; i < count; ++i) Choice[i] = -1;
+    for (i = 0; i < itemcount; ++i) {
+        if (orvibo_set_isglob (Items[i].point)) {
+            globs += 1;
+            continue;
+        }
+        int plug = orvibo_plug_search (Items[i].point);
+        if (plug >= 0) {
+            const char *name = Items[i].point;
+            for (; plug >= 0; plug = orvibo_plug_search_next (name, plug)) {
+                Choice[plug] = i;
+                Items[i].matched += 1;
+            }
+            continue;
+        }
+        const int *members;
+        int membercount =
+            orvibo_scene_members (orvibo_scene_group (Items[i].point), &members);
+        for (j = 0; j < membercount; ++j) Choice[members[j]] = i;
+        Items[i].matched = membercount;
+    }
+    if (globs > 0) {
+        for (i = 0; i < count; ++i) {
+            for (j = itemcount - 1; j > Choice[i]; --j) {
+                if (!orvibo_set_isglob (Items[j].point)) continue;
+                if (orvibo_set_match (Items[j].point, i)) {
+                    Choice[i] = j;
+                    break;
+                }
+            }
+        }
+
+        // A pattern matched even if all its plugs were claimed by later
+        // items, so this is independent from the precedence above.
+        //
+        for (j = 0; j < itemcount; ++j) {
+            if (!orvibo_set_isglob (Items[j].point)) continue;
+            for (i = 0; i < count; ++i) {
+                if (orvibo_set_match (Items[j].point, i)) Items[j].matched += 1;
+            }
+        }
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (Choice[i] < 0) continue;
+        struct SetItem *item = Items + Choice[i];
+        if (orvibo_plug_set (i, item->state, item->pulse) < 0)
+            item->errors += 1;
+        else
+            item->applied += 1;
+    }
+    orvibo_plug_flush ();
+
+    if (!orvibo_status_space (itemcount)) {
+        echttp_error (500, "no more memory");
+        return "";
+    }
+    ParserContext context = echttp_json_start (RenderToken, RenderTokenCount,
+                                               RenderPool, RenderSize);
+    int root = echttp_json_add_object (context, 0, 0);
+    echttp_json_add_string (context, root, "host", HostName);
+    echttp_json_add_integer (context, root, "timestamp", (long)time(0));
+    int results = echttp_json_add_array (context, root, "set");
+
+    for (i = 0; i < itemcount; ++i) {
+        const struct SetItem *item = Items + i;
+        int result = echttp_json_add_object (context, results, 0);
+        echttp_json_add_string (context, result, "point", item->point);
+        echttp_json_add_string (context, result, "state",
+                                item->state ? "on" : "off");
+        echttp_json_add_integer (context, result, "matched", item->matched);
+        echttp_json_add_integer (context, result, "applied", item->applied);
+        if (item->errors)
+            echttp_json_add_integer (context, result, "errors", item->errors);
+    }
+
+    error = echttp_json_export (context, RenderBuffer, RenderSize);
     if (error) {
         echttp_error (500, error);
         return "";
     }
     echttp_content_type_json ();
-    return buffer;
+    return RenderBuffer;
 }
 
 static const char *orvibo_set (const char *method, const char *uri,
@@ -112,6 +474,10 @@ static const char *orvibo_set (const char *method, const char *uri,
     int count = orvibo_plug_count();
     int found = 0;
 
+    orvibo_metrics_add (ORVIBO_HTTP_SET, 1);
+    if (strcmp ("POST", method) == 0 && data && length > 0)
+        return orvibo_set_batch (data, length);
+
     if (!point) {
         echttp_error (404, "missing point name");
         return "";
@@ -135,14 +501,29 @@ static const char *orvibo_set (const char *method, const char *uri,
         return "";
     }
 
-    for (i = 0; i < count; ++i) {
-       if ((strcmp (point, "all") == 0) ||
-           (strcmp (point, orvibo_plug_name(i)) == 0)) {
+    if (orvibo_set_isglob (point)) {
+       for (i = 0; i < count; ++i) {
+           if (!orvibo_set_match (point, i)) continue;
+           if (orvibo_plug_set (i, state, pulse) > 0) found = 1;
+       }
+    } else {
+       i = orvibo_plug_search (point);
+       if (i >= 0) {
            found = 1;
-           orvibo_plug_set (i, state, pulse);
+           for (; i >= 0; i = orvibo_plug_search_next (point, i))
+               orvibo_plug_set (i, state, pulse);
+       } else {
+           const int *members;
+           int membercount =
+               orvibo_scene_members (orvibo_scene_group (point), &members);
+           for (i = 0; i < membercount; ++i) {
+               if (orvibo_plug_set (members[i], state, pulse) > 0) found = 1;
+           }
        }
     }
 
+    orvibo_plug_flush ();
+
     if (! found) {
         echttp_error (404, "invalid point name");
         return "";
@@ -150,12 +531,133 @@ static const char *orvibo_set (const char *method, const char *uri,
     return orvibo_status (method, uri, data, length);
 }
 
+static const char *orvibo_scene (const char *method, const char *uri,
+                                 const char *data, int length) {
+
+    const char *name = echttp_parameter_get("name");
+    if (!name) {
+        echttp_error (404, "missing scene name");
+        return "";
+    }
+    int scene = orvibo_scene_search (name);
+    if (scene < 0) {
+        echttp_error (404, "invalid scene name");
+        return "";
+    }
+    orvibo_scene_activate (scene);
+    orvibo_plug_flush ();
+    return orvibo_status (method, uri, data, length);
+}
+
+// Export the metrics in the Prometheus text format. The per-plug gauges
+// are added here, since the metrics module knows nothing about plugs.
+//
+static const char *orvibo_metrics (const char *method, const char *uri,
+                                   const char *data, int length) {
+
+    static char *buffer = 0;
+    static int size = 0;
+    int count = orvibo_plug_count();
+    int needed = 16384 + (512 * count) + (1024 * orvibo_interface_count());
+    int detected = 0;
+    int configured = 0;
+    int i;
+
+    if (needed > size) {
+        free (buffer);
+        buffer = malloc (needed);
+        size = buffer ? needed : 0;
+        if (!buffer) {
+            echttp_error (500, "no more memory");
+            return "";
+        }
+    }
+    int cursor = orvibo_metrics_export (buffer, size);
+    if (cursor >= 0) {
+        int added = orvibo_interface_export (buffer + cursor, size - cursor);
+        cursor = (added < 0) ? -1 : cursor + added;
+    }
+    if (cursor < 0) {
+        echttp_error (500, "metrics buffer too small");
+        return "";
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (!orvibo_plug_name(i)[0]) continue; // Free slot.
+        configured += 1;
+        if (!orvibo_plug_failure(i)) detected += 1;
+    }
+    cursor += snprintf (buffer + cursor, size - cursor,
+                        "# HELP orvibo_plugs Number of plugs\n"
+                        "# TYPE orvibo_plugs gauge\n"
+                        "orvibo_plugs{state=\"known\"} %d\n"
+                        "orvibo_plugs{state=\"detected\"} %d\n"
+                        "orvibo_plugs{state=\"capacity\"} %d\n"
+                        "# HELP orvibo_tx_queue_depth Frames waiting for transmission\n"
+                        "# TYPE orvibo_tx_queue_depth gauge\n"
+                        "orvibo_tx_queue_depth{class=\"command\"} %d\n"
+                        "orvibo_tx_queue_depth{class=\"retry\"} %d\n"
+                        "orvibo_tx_queue_depth{class=\"probe\"} %d\n"
+                        "# HELP orvibo_tx_rate Maximum frames sent per second (0: unlimited)\n"
+                        "# TYPE orvibo_tx_rate gauge\n"
+                        "orvibo_tx_rate %d\n"
+                        "# HELP orvibo_rx_ring_depth Updates waiting in the ingest ring\n"
+                        "# TYPE orvibo_rx_ring_depth gauge\n"
+                        "orvibo_rx_ring_depth{mode=\"%s\"} %d\n"
+                        "# HELP orvibo_plug_latency_milliseconds Command latency per plug\n"
+                        "# TYPE orvibo_plug_latency_milliseconds summary\n",
+                        configured, detected, orvibo_plug_capacity(),
+                        orvibo_pacer_depth (ORVIBO_PACER_COMMAND),
+                        orvibo_pacer_depth (ORVIBO_PACER_RETRY),
+                        orvibo_pacer_depth (ORVIBO_PACER_PROBE),
+                        orvibo_pacer_rate (),
+                        orvibo_ingest_threaded () ? "thread" : "inline",
+                        orvibo_ingest_depth ());
+
+    for (i = 0; i < count && cursor < size; ++i) {
+        int p50, p99, max;
+        int acked = orvibo_plug_latency (i, &p50, &p99, &max);
+        if (!acked) continue;
+        char escaped[128];
+        const char *name =
+            orvibo_metrics_label (orvibo_plug_name(i), escaped, sizeof(escaped));
+        cursor += snprintf (buffer + cursor, size - cursor,
+              "orvibo_plug_latency_milliseconds{plug=\"%s\",quantile=\"0.5\"} %d\n"
+              "orvibo_plug_latency_milliseconds{plug=\"%s\",quantile=\"0.99\"} %d\n"
+              "orvibo_plug_latency_milliseconds{plug=\"%s\",quantile=\"1\"} %d\n"
+              "orvibo_plug_latency_milliseconds_count{plug=\"%s\"} %d\n",
+              name, p50, name, p99, name, max, name, acked);
+    }
+    if (cursor >= size) {
+        echttp_error (500, "metrics buffer too small");
+        return "";
+    }
+    echttp_content_type_set ("text/plain; version=0.0.4");
+    return buffer;
+}
+
 static const char *orvibo_config (const char *method, const char *uri,
                                   const char *data, int length) {
 
     if (strcmp ("GET", method) == 0) {
-        static char buffer[65537];
-        orvibo_plug_live_config (buffer, sizeof(buffer));
+        static char *buffer = 0;
+        static int size = 0;
+        int needed = 4096 + (384 * orvibo_plug_count())
+                          + (64 * orvibo_scene_tokens());
+        if (needed > size) {
+            free (buffer);
+            buffer = malloc (needed);
+            size = buffer ? needed : 0;
+            if (!buffer) {
+                echttp_error (500, "no more memory");
+                return "";
+            }
+        }
+        const char *error = orvibo_plug_live_config (buffer, size);
+        if (error) {
+            echttp_error (500, error);
+            return "";
+        }
         echttp_content_type_json ();
         return buffer;
     }
@@ -180,6 +682,7 @@ static void orvibo_background (int fd, int mode) {
 
     houseportal_background (now);
     orvibo_plug_periodic (now);
+    orvibo_event_background (now);
     housediscover (now);
     houselog_background (now);
     houseconfig_background (now);
@@ -204,6 +707,7 @@ int main (int argc, const char **argv) {
     signal(SIGPIPE, SIG_IGN);
 
     gethostname (HostName, sizeof(HostName));
+    StatusEpoch = time(0);
 
     echttp_default ("-http-service=dynamic");
 
@@ -216,6 +720,7 @@ int main (int argc, const char **argv) {
     housediscover_initialize (argc, argv);
     houselog_initialize ("orvibo", argc, argv);
     housedepositor_initialize (argc, argv);
+    orvibo_event_initialize (argc, argv);
 
     error = houseconfig_initialize ("orvibo", orvibo_plug_refresh, argc, argv);
     if (error) {
@@ -231,6 +736,8 @@ int main (int argc, const char **argv) {
 
     echttp_route_uri ("/orvibo/status", orvibo_status);
     echttp_route_uri ("/orvibo/set",    orvibo_set);
+    echttp_route_uri ("/orvibo/scene",  orvibo_scene);
+    echttp_route_uri ("/orvibo/metrics", orvibo_metrics);
 
     echttp_route_uri ("/orvibo/config", orvibo_config);
 
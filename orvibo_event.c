@@ -0,0 +1,275 @@
+/* orvibo - A simple home web server for control of orvibo WiFi plugs
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * orvibo_event.c - Coalesce and rate-limit the device events.
+ *
+ * This module sits between the plug logic and houselog_event(), so that
+ * a flapping plug, or a network outage affecting many plugs, does not
+ * flood the event log. It is only used for the transitions reported by
+ * the plugs themselves (CHANGED, DETECTED, SILENT, RETRY, UNREACHABLE):
+ * the user commands and configuration changes are always logged. The
+ * first event of a given kind for a given device is logged immediately.
+ * The same event repeated within the coalescing window is only counted,
+ * and a single summary is logged at the end of the window, for example:
+ *
+ *    DEVICE plug1 CHANGED 14 TIMES IN 60 SECONDS, LAST FROM on TO off
+ *
+ * In addition, the total event rate is capped: an event beyond the cap
+ * is counted, and reported in the next summary for that device. The
+ * number of events logged and suppressed is reported in the metrics.
+ *
+ * SYNOPSYS:
+ *
+ * void orvibo_event_initialize (int argc, const char **argv);
+ *
+ *    Initialize the event aggregation. The following options are
+ *    recognized:
+ *
+ *    -orvibo-event-window=N  The coalescing window in seconds (default: 60).
+ *    -orvibo-event-rate=N    The maximum number of events logged per
+ *                            second (default: 10).
+ *
+ * void orvibo_event (const char *category, const char *object,
+ *                    const char *action, const char *format, ...);
+ *
+ *    Same as houselog_event(), with coalescing and rate limiting.
+ *
+ * void orvibo_event_background (time_t now);
+ *
+ *    Log the summaries of the windows that ended. This function must
+ *    be called every second.
+ */
+
+#include <time.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "echttp.h"
+#include "houselog.h"
+
+#include "orvibo_metrics.h"
+#include "orvibo_event.h"
+
+struct EventEntry {
+    char category[16];
+    char object[32];
+    char action[16];
+    char last[128];
+    time_t start;
+    int count;     // Events not logged since the start of the window.
+    int next;      // Hash chain, -1 terminated.
+};
+
+static struct EventEntry *Events = 0;
+static int EventsCount = 0;
+static int EventsSpace = 0;
+
+static int *EventsHash = 0;
+static int EventsHashSize = 0; // Power of 2.
+
+static int EventWindow = 60;
+static int EventRate = 10;
+static int EventBurst = 50;
+static int EventTokens = 50;
+
+static unsigned int orvibo_event_hash (const char *category,
+                                       const char *object, const char *action) {
+    unsigned int hash = 2166136261u; // FNV-1a.
+    const char *s;
+    for (s = category; *s; ++s) hash = (hash ^ (unsigned char)*s) * 16777619u;
+    for (s = object; *s; ++s) hash = (hash ^ (unsigned char)*s) * 16777619u;
+    for (s = action; *s; ++s) hash = (hash ^ (unsigned char)*s) * 16777619u;
+    return hash;
+}
+
+static void orvibo_event_reindex (void) {
+    int i;
+    for (i = 0; i < EventsHashSize; ++i) EventsHash[i] = -1;
+    for (i = 0; i < EventsCount; ++i) {
+        struct EventEntry *e = Events + i;
+        unsigned int bucket =
+            orvibo_event_hash (e->category, e->object, e->action)
+                & (EventsHashSize - 1);
+        e->next = EventsHash[bucket];
+        EventsHash[bucket] = i;
+    }
+}
+
+static struct EventEntry *orvibo_event_find (const char *category,
+                                             const char *object,
+                                             const char *action) {
+    if (!EventsHashSize) return 0;
+    unsigned int bucket =
+        orvibo_event_hash (category, object, action) & (EventsHashSize - 1);
+    int i;
+    for (i = EventsHash[bucket]; i >= 0; i = Events[i].next) {
+        struct EventEntry *e = Events + i;
+        if (strcmp (e->object, object)) continue;
+        if (strcmp (e->action, action)) continue;
+        if (strcmp (e->category, category)) continue;
+        return e;
+    }
+    return 0;
+}
+
+static struct EventEntry *orvibo_event_add (const char *category,
+                                            const char *object,
+                                            const char *action) {
+    if (EventsCount >= EventsSpace) {
+        int space = EventsSpace ? 2 * EventsSpace : 256;
+        struct EventEntry *events = realloc (Events, space * sizeof(*events));
+        if (!events) return 0;
+        Events = events;
+        EventsSpace = space;
+    }
+    if (2 * EventsSpace > EventsHashSize) {
+        int size = EventsHashSize ? EventsHashSize : 512;
+        while (size < 2 * EventsSpace) size *= 2;
+        int *hash = realloc (EventsHash, size * sizeof(int));
+        if (!hash) return 0;
+        EventsHash = hash;
+        EventsHashSize = size;
+        orvibo_event_reindex ();
+    }
+    struct EventEntry *e = Events + EventsCount;
+    snprintf (e->category, sizeof(e->category), "%s", category);
+    snprintf (e->object, sizeof(e->object), "%s", object);
+    snprintf (e->action, sizeof(e->action), "%s", action);
+    e->last[0] = 0;
+    e->count = 0;
+    e->start = 0;
+
+    unsigned int bucket =
+        orvibo_event_hash (e->category, e->object, e->action)
+            & (EventsHashSize - 1);
+    e->next = EventsHash[bucket];
+    EventsHash[bucket] = EventsCount++;
+    return e;
+}
+
+static void orvibo_event_suppress (struct EventEntry *e, const char *text) {
+    e->count += 1;
+    snprintf (e->last, sizeof(e->last), "%s", text);
+    orvibo_metrics_add (ORVIBO_EVENTS_SUPPRESSED, 1);
+}
+
+// Log the summary of the window, if the rate allows it.
+//
+static int orvibo_event_summary (struct EventEntry *e, time_t now) {
+    if (e->count <= 0) return 1;
+    if (EventTokens <= 0) return 0;
+    EventTokens -= 1;
+    houselog_event (e->category, e->object, e->action,
+                    "%d TIMES IN %d SECONDS, LAST %s",
+                    e->count, (int)(now - e->start), e->last);
+    orvibo_metrics_add (ORVIBO_EVENTS_LOGGED, 1);
+    e->count = 0;
+    e->start = now; // Keep coalescing while the device keeps flapping.
+    return 1;
+}
+
+void orvibo_event (const char *category, const char *object,
+                   const char *action, const char *format, ...) {
+
+    char text[128];
+    va_list ap;
+    va_start (ap, format);
+    vsnprintf (text, sizeof(text), format, ap);
+    va_end (ap);
+
+    time_t now = time(0);
+    struct EventEntry *e = orvibo_event_find (category, object, action);
+    if (!e) {
+        e = orvibo_event_add (category, object, action);
+        if (!e) { // No memory left: do not lose the event.
+            houselog_event (category, object, action, "%s", text);
+            return;
+        }
+    } else if (now < e->start + EventWindow) {
+        orvibo_event_suppress (e, text);
+        return;
+    } else {
+        orvibo_event_summary (e, now);
+        if (e->count > 0) { // The rate limit was reached.
+            orvibo_event_suppress (e, text);
+            return;
+        }
+    }
+
+    if (EventTokens <= 0) {
+        e->start = now;
+        orvibo_event_suppress (e, text);
+        return;
+    }
+    EventTokens -= 1;
+    e->start = now;
+    houselog_event (category, object, action, "%s", text);
+    orvibo_metrics_add (ORVIBO_EVENTS_LOGGED, 1);
+}
+
+void orvibo_event_background (time_t now) {
+
+    static time_t LastRefill = 0;
+    int i, j;
+
+    if (now == LastRefill) return;
+    EventTokens += EventRate * (LastRefill ? (int)(now - LastRefill) : 1);
+    if (EventTokens > EventBurst) EventTokens = EventBurst;
+    LastRefill = now;
+
+    // Log the summaries of the windows that ended, and forget about the
+    // devices that have been quiet for a whole window.
+    //
+    int removed = 0;
+    for (i = 0, j = 0; i < EventsCount; ++i) {
+        struct EventEntry *e = Events + i;
+        if (now >= e->start + EventWindow) {
+            if (e->count <= 0) {
+                removed += 1;
+                continue;
+            }
+            orvibo_event_summary (e, now);
+        }
+        if (i != j) Events[j] = *e;
+        j += 1;
+    }
+    EventsCount = j;
+    if (removed) orvibo_event_reindex ();
+}
+
+void orvibo_event_initialize (int argc, const char **argv) {
+
+    const char *option;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-orvibo-event-window=", argv[i], &option))
+            EventWindow = atoi(option);
+        else if (echttp_option_match ("-orvibo-event-rate=", argv[i], &option))
+            EventRate = atoi(option);
+    }
+    if (EventWindow < 0) EventWindow = 0;
+    if (EventRate < 1) EventRate = 1;
+    EventBurst = 5 * EventRate;
+    EventTokens = EventBurst;
+}
+
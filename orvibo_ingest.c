@@ -0,0 +1,365 @@
+/* orvibo - A simple home web server for control of orvibo WiFi plugs
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * orvibo_ingest.c - Reception and decoding of the UDP datagrams.
+ *
+ * This module reads the datagrams from the sockets of all interfaces
+ * (see orvibo_interface.c) in batches, using recvmmsg(). Each datagram
+ * is first decoded into a compact update, then the update is applied
+ * to the plugs. Both steps are provided by the caller: the decoder must
+ * not access any shared state, since it may run in a separate thread.
+ *
+ * By default, the reception runs in the main loop. In threaded mode, a
+ * dedicated thread receives and decodes the datagrams, and publishes
+ * the updates through a lock-free single producer, single consumer ring.
+ * The main loop is woken up through an eventfd, and applies the updates.
+ * This way, a slow HTTP request does not delay the draining of the
+ * sockets: the datagrams wait in the ring, which holds more updates than
+ * the kernel's receive buffer holds datagrams.
+ *
+ * The ingest latency, i.e. the delay between the reception of the
+ * datagram by the kernel and the update being applied, is measured in
+ * both modes, as well as the datagrams dropped by the kernel or because
+ * the ring was full.
+ *
+ * SYNOPSYS:
+ *
+ * void orvibo_ingest_initialize (int argc, const char **argv,
+ *                                orvibo_ingest_decoder *decoder,
+ *                                orvibo_ingest_consumer *consumer);
+ *
+ *    Start receiving from all interfaces. The following option is
+ *    recognized:
+ *
+ *    -orvibo-ingest=inline|thread  Where the datagrams are received and
+ *                                  decoded (default: inline).
+ *
+ * int orvibo_ingest_threaded (void);
+ *
+ *    Return 1 if the datagrams are received in a separate thread.
+ *
+ * int orvibo_ingest_depth (void);
+ *
+ *    Return the number of updates waiting in the ring.
+ */
+
+#define _GNU_SOURCE // For recvmmsg().
+
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+
+#include "echttp.h"
+#include "houselog.h"
+
+#include "orvibo_timer.h"
+#include "orvibo_metrics.h"
+#include "orvibo_interface.h"
+#include "orvibo_ingest.h"
+
+// The receive ring is a preallocated set of packet buffers, filled by
+// recvmmsg() in batches. The kernel reports the number of datagrams it
+// dropped (SO_RXQ_OVFL) and the time of reception (SO_TIMESTAMPNS) as
+// ancillary data attached to each packet.
+//
+#define ORVIBO_RXBATCH 64
+#define ORVIBO_RXROUNDS 16 // Do not starve the HTTP clients, or the
+                           // other interfaces.
+#define ORVIBO_PACKETMAX 128
+#define ORVIBO_RXCONTROL \
+    (CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct timespec)))
+
+static struct mmsghdr RxQueue[ORVIBO_RXBATCH];
+static struct iovec RxData[ORVIBO_RXBATCH];
+static struct sockaddr_in RxAddress[ORVIBO_RXBATCH];
+static unsigned char RxPacket[ORVIBO_RXBATCH][ORVIBO_PACKETMAX];
+static char RxControl[ORVIBO_RXBATCH][ORVIBO_RXCONTROL];
+
+// The kernel drop counters, as last seen by the receiver, and as last
+// reported by the main loop.
+//
+static uint32_t RxDropped[ORVIBO_INTERFACE_MAX];
+static uint32_t RxDroppedReported[ORVIBO_INTERFACE_MAX];
+
+static orvibo_ingest_decoder *IngestDecoder = 0;
+static orvibo_ingest_consumer *IngestConsumer = 0;
+
+// The ring between the receive thread (producer) and the main loop
+// (consumer). Each index is only written by one side.
+//
+#define ORVIBO_INGEST_RING 4096 // Must be a power of 2.
+
+static struct OrviboUpdate IngestRing[ORVIBO_INGEST_RING];
+static unsigned int IngestHead = 0; // Next to consume.
+static unsigned int IngestTail = 0; // Next to produce.
+
+static int IngestThreaded = 0;
+static int IngestEvent = -1;
+static pthread_t IngestThread;
+
+static long long orvibo_ingest_realtime (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_REALTIME, &now);
+    return ((long long)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+// Extract the ancillary data. Only accumulate the kernel drops here,
+// since this may run in the receive thread.
+//
+static long long orvibo_ingest_control (const struct msghdr *h, int interface) {
+
+    long long kernel = 0;
+    struct cmsghdr *c;
+    for (c = CMSG_FIRSTHDR(h); c; c = CMSG_NXTHDR((struct msghdr *)h, c)) {
+        if (c->cmsg_level != SOL_SOCKET) continue;
+        if (c->cmsg_type == SO_TIMESTAMPNS) {
+            struct timespec stamp;
+            memcpy (&stamp, CMSG_DATA(c), sizeof(stamp));
+            kernel = ((long long)stamp.tv_sec * 1000000) + (stamp.tv_nsec / 1000);
+        } else if (c->cmsg_type == SO_RXQ_OVFL) {
+            uint32_t dropped;
+            memcpy (&dropped, CMSG_DATA(c), sizeof(dropped));
+            uint32_t previous =
+                __atomic_load_n (RxDropped + interface, __ATOMIC_RELAXED);
+            if (dropped != previous) {
+                orvibo_metrics_add (ORVIBO_RX_DROPPED, dropped - previous);
+                orvibo_interface_add (interface, ORVIBO_IF_RX_DROPPED,
+                                      dropped - previous);
+                __atomic_store_n (RxDropped + interface, dropped,
+                                  __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return kernel;
+}
+
+// Log the kernel drops from the main loop.
+//
+static void orvibo_ingest_report (void) {
+    int i;
+    for (i = 0; i < orvibo_interface_count(); ++i) {
+        uint32_t dropped = __atomic_load_n (RxDropped + i, __ATOMIC_RELAXED);
+        if (dropped == RxDroppedReported[i]) continue;
+        houselog_trace (HOUSE_WARNING, "PLUG",
+                        "%u datagrams dropped by the kernel on %s (%u total)",
+                        dropped - RxDroppedReported[i],
+                        orvibo_interface_name(i), dropped);
+        RxDroppedReported[i] = dropped;
+    }
+}
+
+static void orvibo_ingest_apply (const struct OrviboUpdate *update,
+                                 long long realtime) {
+    IngestConsumer (update);
+    if (update->kernel > 0)
+        orvibo_metrics_record (ORVIBO_HIST_INGEST_US,
+                               realtime - update->kernel);
+}
+
+static int orvibo_ingest_push (const struct OrviboUpdate *update) {
+
+    unsigned int tail = IngestTail; // Only written by this thread.
+    unsigned int head = __atomic_load_n (&IngestHead, __ATOMIC_ACQUIRE);
+    if (tail - head >= ORVIBO_INGEST_RING) return 0;
+
+    IngestRing[tail & (ORVIBO_INGEST_RING - 1)] = *update;
+    __atomic_store_n (&IngestTail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Receive and decode all the pending datagrams from one socket. In
+// threaded mode, the updates are published to the ring; otherwise they
+// are applied immediately. Return the number of updates published.
+//
+static int orvibo_ingest_receive (int fd, int interface) {
+
+    int published = 0;
+    int round;
+
+    for (round = 0; round < ORVIBO_RXROUNDS; ++round) {
+        int i;
+        for (i = 0; i < ORVIBO_RXBATCH; ++i) {
+            RxQueue[i].msg_hdr.msg_namelen = sizeof(RxAddress[i]);
+            RxQueue[i].msg_hdr.msg_control = RxControl[i];
+            RxQueue[i].msg_hdr.msg_controllen = sizeof(RxControl[i]);
+        }
+        int count = recvmmsg (fd, RxQueue, ORVIBO_RXBATCH, MSG_DONTWAIT, 0);
+        if (count <= 0) break;
+
+        long long now = orvibo_timer_now ();
+        long long realtime = orvibo_ingest_realtime ();
+        orvibo_metrics_add (ORVIBO_RX_PACKETS, count);
+        orvibo_interface_add (interface, ORVIBO_IF_RX_PACKETS, count);
+        for (i = 0; i < count; ++i) {
+            struct OrviboUpdate update;
+            orvibo_metrics_add (ORVIBO_RX_BYTES, RxQueue[i].msg_len);
+            orvibo_interface_add (interface, ORVIBO_IF_RX_BYTES, RxQueue[i].msg_len);
+            update.kernel = orvibo_ingest_control (&(RxQueue[i].msg_hdr), interface);
+            if (!IngestDecoder (RxPacket[i], RxQueue[i].msg_len, &update))
+                continue;
+            update.address = RxAddress[i];
+            update.interface = interface;
+            update.timestamp = now;
+            if (!update.kernel) update.kernel = realtime;
+
+            if (!IngestThreaded) {
+                orvibo_ingest_apply (&update, orvibo_ingest_realtime ());
+            } else if (orvibo_ingest_push (&update)) {
+                published += 1;
+            } else {
+                orvibo_metrics_add (ORVIBO_RX_RINGFULL, 1);
+            }
+        }
+        if (count < ORVIBO_RXBATCH) break; // Socket was drained.
+    }
+    return published;
+}
+
+static void orvibo_ingest_inline (int fd, int mode) {
+    int interface = orvibo_interface_find (fd);
+    if (interface < 0) return; // Never happens.
+    orvibo_ingest_receive (fd, interface);
+    orvibo_ingest_report ();
+}
+
+static void *orvibo_ingest_loop (void *context) {
+
+    struct pollfd sockets[ORVIBO_INTERFACE_MAX];
+    int count = orvibo_interface_count ();
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        sockets[i].fd = orvibo_interface_socket (i);
+        sockets[i].events = POLLIN;
+    }
+    for (;;) {
+        if (poll (sockets, count, -1) <= 0) continue;
+
+        int published = 0;
+        for (i = 0; i < count; ++i) {
+            if (sockets[i].revents & POLLIN)
+                published += orvibo_ingest_receive (sockets[i].fd, i);
+        }
+        if (published > 0) {
+            uint64_t signal = 1;
+            if (write (IngestEvent, &signal, sizeof(signal)) < 0) continue;
+        }
+    }
+    return 0;
+}
+
+// Apply the updates published by the receive thread. Do not consume
+// more than one ring's worth at a time, so that a continuous flow of
+// datagrams does not starve the HTTP clients.
+//
+static void orvibo_ingest_wakeup (int fd, int mode) {
+
+    uint64_t signal;
+    if (read (fd, &signal, sizeof(signal)) < 0) signal = 0;
+
+    long long realtime = orvibo_ingest_realtime ();
+    unsigned int head = IngestHead; // Only written by this thread.
+    unsigned int tail = __atomic_load_n (&IngestTail, __ATOMIC_ACQUIRE);
+    int budget = ORVIBO_INGEST_RING;
+
+    while (head != tail && budget-- > 0) {
+        orvibo_ingest_apply (IngestRing + (head & (ORVIBO_INGEST_RING - 1)),
+                             realtime);
+        head += 1;
+        __atomic_store_n (&IngestHead, head, __ATOMIC_RELEASE);
+        if (head == tail)
+            tail = __atomic_load_n (&IngestTail, __ATOMIC_ACQUIRE);
+    }
+    if (head != tail) {
+        signal = 1; // Come back later for the rest.
+        if (write (IngestEvent, &signal, sizeof(signal)) < 0) return;
+    }
+    orvibo_ingest_report ();
+}
+
+int orvibo_ingest_threaded (void) {
+    return IngestThreaded;
+}
+
+int orvibo_ingest_depth (void) {
+    return __atomic_load_n (&IngestTail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n (&IngestHead, __ATOMIC_ACQUIRE);
+}
+
+void orvibo_ingest_initialize (int argc, const char **argv,
+                               orvibo_ingest_decoder *decoder,
+                               orvibo_ingest_consumer *consumer) {
+
+    const char *option;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-orvibo-ingest=", argv[i], &option))
+            IngestThreaded = (strcmp (option, "thread") == 0);
+    }
+    IngestDecoder = decoder;
+    IngestConsumer = consumer;
+
+    for (i = 0; i < ORVIBO_RXBATCH; ++i) {
+        RxData[i].iov_base = RxPacket[i];
+        RxData[i].iov_len = sizeof(RxPacket[i]);
+        RxQueue[i].msg_hdr.msg_iov = RxData + i;
+        RxQueue[i].msg_hdr.msg_iovlen = 1;
+        RxQueue[i].msg_hdr.msg_name = RxAddress + i;
+    }
+
+    for (i = 0; i < orvibo_interface_count(); ++i) {
+        int value = 1;
+        if (setsockopt (orvibo_interface_socket(i), SOL_SOCKET,
+                        SO_TIMESTAMPNS, &value, sizeof(value)) < 0)
+            houselog_trace (HOUSE_WARNING, "PLUG",
+                            "cannot timestamp datagrams: %s", strerror(errno));
+    }
+
+    if (IngestThreaded) {
+        IngestEvent = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (IngestEvent < 0) {
+            houselog_trace (HOUSE_FAILURE, "PLUG",
+                            "cannot create eventfd: %s", strerror(errno));
+            exit(1);
+        }
+        echttp_listen (IngestEvent, 1, orvibo_ingest_wakeup, 0);
+        if (pthread_create (&IngestThread, 0, orvibo_ingest_loop, 0)) {
+            houselog_trace (HOUSE_FAILURE, "PLUG",
+                            "cannot start the receive thread");
+            exit(1);
+        }
+        houselog_trace (HOUSE_INFO, "PLUG", "receiving in a separate thread");
+    } else {
+        for (i = 0; i < orvibo_interface_count(); ++i)
+            echttp_listen (orvibo_interface_socket(i), 1, orvibo_ingest_inline, 0);
+    }
+}
+
@@ -0,0 +1,44 @@
+/* orvibo - A simple home web server for world domination through Orvibo plugs.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * orvibo_ingest.h - Reception and decoding of the UDP datagrams.
+ *
+ */
+struct OrviboUpdate {
+    uint64_t mac;
+    struct sockaddr_in address;
+    long long timestamp; // Monotonic time of the reception (ms).
+    long long kernel;    // Time of the kernel reception (realtime, us).
+    short interface;
+    unsigned char kind;  // Defined by the decoder.
+    unsigned char state;
+};
+
+typedef int orvibo_ingest_decoder (const unsigned char *data, int size,
+                                   struct OrviboUpdate *update);
+typedef void orvibo_ingest_consumer (const struct OrviboUpdate *update);
+
+void orvibo_ingest_initialize (int argc, const char **argv,
+                               orvibo_ingest_decoder *decoder,
+                               orvibo_ingest_consumer *consumer);
+
+int  orvibo_ingest_threaded (void);
+int  orvibo_ingest_depth (void);
+
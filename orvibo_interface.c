@@ -0,0 +1,413 @@
+/* orvibo - A simple home web server for control of orvibo WiFi plugs
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * orvibo_interface.c - The UDP sockets, one per network interface.
+ *
+ * By default, a single socket is bound to all interfaces and the discovery
+ * requests are sent to the limited broadcast address: this only reaches
+ * the plugs on the subnet of the default route. To serve plugs spread
+ * over several subnets or VLANs, this module can open one socket per
+ * network interface, bound to that interface (SO_BINDTODEVICE), and send
+ * the discovery requests to each interface's directed broadcast address.
+ *
+ * Each interface has its own counters, exported with the metrics.
+ *
+ * SYNOPSYS:
+ *
+ * int orvibo_interface_initialize (int argc, const char **argv);
+ *
+ *    Open the UDP sockets. Return the number of interfaces. The following
+ *    options are recognized:
+ *
+ *    -orvibo-interface=all|NAME[,NAME..]
+ *                                Open one socket per interface: either
+ *                                all the IPv4 interfaces that support
+ *                                broadcast, or the listed ones. Binding
+ *                                to an interface requires CAP_NET_RAW.
+ *    -orvibo-port=PORT           The local UDP port (default: 10000).
+ *    -orvibo-discovery=HOST[:PORT]
+ *                                Where to send the discovery requests
+ *                                (default: broadcast on port 10000),
+ *                                for all interfaces.
+ *
+ * int orvibo_interface_count (void);
+ * const char *orvibo_interface_name (int i);
+ * int orvibo_interface_socket (int i);
+ * const struct sockaddr_in *orvibo_interface_broadcast (int i);
+ *
+ *    Access the interfaces, by index. The name is "any" when a single
+ *    socket is bound to all interfaces.
+ *
+ * int orvibo_interface_find (int fd);
+ *
+ *    Return the index of the interface that owns the socket, or -1.
+ *
+ * int orvibo_interface_route (const struct sockaddr_in *a);
+ *
+ *    Return the index of the interface which subnet contains the address,
+ *    or 0 if none does.
+ *
+ * void orvibo_interface_add (int i, int counter, long long value);
+ *
+ *    Add the value to the specified counter of the interface.
+ *
+ * int orvibo_interface_export (char *buffer, int size);
+ *
+ *    Format the interface counters using the Prometheus text format.
+ *    Return the length of the text, or -1 if the buffer is too small.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <ifaddrs.h>
+#include <arpa/inet.h>
+
+#include "echttp.h"
+#include "houselog.h"
+
+#include "orvibo_metrics.h"
+#include "orvibo_interface.h"
+
+#define ORVIBO_RCVBUF (1024*1024)
+
+struct OrviboInterface {
+    char name[IFNAMSIZ];
+    int socket;
+    struct sockaddr_in broadcast;
+    in_addr_t address; // Network order.
+    in_addr_t netmask; // Network order, 0 matches all.
+    long long counters[ORVIBO_IF_COUNTERS];
+};
+
+static struct OrviboInterface Interfaces[ORVIBO_INTERFACE_MAX];
+static int InterfacesCount = 0;
+
+static const char *InterfaceCounterName[ORVIBO_IF_COUNTERS][2] = {
+    [ORVIBO_IF_RX_PACKETS] = {"orvibo_interface_rx_packets_total",
+                              "UDP datagrams received per interface"},
+    [ORVIBO_IF_RX_BYTES] = {"orvibo_interface_rx_bytes_total",
+                            "UDP bytes received per interface"},
+    [ORVIBO_IF_RX_DROPPED] = {"orvibo_interface_rx_dropped_total",
+                              "UDP datagrams dropped by the kernel per interface"},
+    [ORVIBO_IF_BROADCAST] = {"orvibo_interface_discovery_total",
+                             "Discovery requests sent per interface"},
+    [ORVIBO_IF_DETECTED] = {"orvibo_interface_detected_total",
+                            "Plugs detected per interface"},
+};
+
+int orvibo_interface_count (void) {
+    return InterfacesCount;
+}
+
+const char *orvibo_interface_name (int i) {
+    if (i < 0 || i >= InterfacesCount) return "";
+    return Interfaces[i].name;
+}
+
+int orvibo_interface_socket (int i) {
+    if (i < 0 || i >= InterfacesCount) i = 0;
+    return Interfaces[i].socket;
+}
+
+const struct sockaddr_in *orvibo_interface_broadcast (int i) {
+    if (i < 0 || i >= InterfacesCount) i = 0;
+    return &(Interfaces[i].broadcast);
+}
+
+int orvibo_interface_find (int fd) {
+    int i;
+    for (i = 0; i < InterfacesCount; ++i) {
+        if (Interfaces[i].socket == fd) return i;
+    }
+    return -1;
+}
+
+int orvibo_interface_route (const struct sockaddr_in *a) {
+    int i;
+    for (i = 0; i < InterfacesCount; ++i) {
+        struct OrviboInterface *f = Interfaces + i;
+        if ((a->sin_addr.s_addr & f->netmask) == (f->address & f->netmask))
+            return i;
+    }
+    return 0;
+}
+
+void orvibo_interface_add (int i, int counter, long long value) {
+    if (i < 0 || i >= InterfacesCount) return;
+    if (counter < 0 || counter >= ORVIBO_IF_COUNTERS) return;
+    __atomic_add_fetch (&(Interfaces[i].counters[counter]), value,
+                        __ATOMIC_RELAXED);
+}
+
+int orvibo_interface_export (char *buffer, int size) {
+
+    int cursor = 0;
+    int c, i;
+
+    for (c = 0; c < ORVIBO_IF_COUNTERS; ++c) {
+        cursor += snprintf (buffer + cursor, size - cursor,
+                            "# HELP %s %s\n# TYPE %s counter\n",
+                            InterfaceCounterName[c][0],
+                            InterfaceCounterName[c][1],
+                            InterfaceCounterName[c][0]);
+        if (cursor >= size) return -1;
+        for (i = 0; i < InterfacesCount; ++i) {
+            char escaped[2 * IFNAMSIZ];
+            long long value = __atomic_load_n (&(Interfaces[i].counters[c]),
+                                               __ATOMIC_RELAXED);
+            cursor += snprintf (buffer + cursor, size - cursor,
+                                "%s{interface=\"%s\"} %lld\n",
+                                InterfaceCounterName[c][0],
+                                orvibo_metrics_label (Interfaces[i].name,
+                                                      escaped, sizeof(escaped)),
+                                value);
+            if (cursor >= size) return -1;
+        }
+    }
+    return cursor;
+}
+
+static void orvibo_interface_discovery (const char *target,
+                                        struct sockaddr_in *address) {
+
+    char host[256];
+    int port = 10000;
+
+    snprintf (host, sizeof(host), "%s", target);
+    char *sep = strchr (host, ':');
+    if (sep) {
+        *sep = 0;
+        port = atoi(sep+1);
+    }
+    struct addrinfo hints;
+    struct addrinfo *resolved;
+    memset (&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo (host, 0, &hints, &resolved)) {
+        houselog_trace (HOUSE_FAILURE, "PLUG",
+                        "cannot resolve discovery address %s", host);
+        exit(1);
+    }
+    *address = *((struct sockaddr_in *)(resolved->ai_addr));
+    address->sin_port = htons(port);
+    freeaddrinfo (resolved);
+}
+
+// Open a socket, bound to the specified device if any. Return -1 if the
+// socket could not be setup.
+//
+static int orvibo_interface_open (const char *device, int port) {
+
+    struct sockaddr_in local;
+    memset (&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr.s_addr = INADDR_ANY;
+
+    int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s < 0) {
+        houselog_trace (HOUSE_FAILURE, "PLUG",
+                        "cannot open UDP socket: %s", strerror(errno));
+        return -1;
+    }
+
+    int value = 1;
+    if (device) {
+        // All the sockets share the same port: each only receives
+        // the datagrams that arrived through its own device.
+        //
+        if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) < 0 ||
+            setsockopt(s, SOL_SOCKET, SO_BINDTODEVICE,
+                       device, strlen(device)+1) < 0) {
+            houselog_trace (HOUSE_FAILURE, "PLUG",
+                            "cannot bind to interface %s: %s",
+                            device, strerror(errno));
+            close(s);
+            return -1;
+        }
+    }
+
+    if (bind(s, (struct sockaddr *)(&local), sizeof(local)) < 0) {
+        houselog_trace (HOUSE_FAILURE, "PLUG",
+                        "cannot bind to UDP port %d: %s",
+                        port, strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    if (setsockopt(s, SOL_SOCKET, SO_BROADCAST, &value, sizeof(value)) < 0) {
+        houselog_trace (HOUSE_FAILURE, "PLUG",
+                        "cannot broadcast: %s", strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    // A discovery broadcast causes all plugs to reply at the same time:
+    // make room for these bursts, and ask the kernel to report drops.
+    //
+    value = ORVIBO_RCVBUF;
+    if (setsockopt(s, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value)) < 0) {
+        houselog_trace (HOUSE_WARNING, "PLUG",
+                        "cannot set receive buffer: %s", strerror(errno));
+    }
+    value = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &value, sizeof(value)) < 0) {
+        houselog_trace (HOUSE_WARNING, "PLUG",
+                        "cannot monitor drops: %s", strerror(errno));
+    }
+    socklen_t length = sizeof(value);
+    if (getsockopt(s, SOL_SOCKET, SO_RCVBUF, &value, &length) < 0)
+        value = 0;
+
+    houselog_trace (HOUSE_INFO, "PLUG",
+                    "UDP port %d is now open on %s (receive buffer %d bytes)",
+                    port, device?device:"all interfaces", value);
+    return s;
+}
+
+static int orvibo_interface_selected (const char *list, const char *name) {
+
+    if (!strcmp (list, "all")) return 1;
+
+    int length = strlen(name);
+    const char *cursor = list;
+    while (*cursor) {
+        const char *end = strchr (cursor, ',');
+        int size = end ? (end - cursor) : strlen(cursor);
+        if (size == length && !strncmp (cursor, name, size)) return 1;
+        if (!end) break;
+        cursor = end + 1;
+    }
+    return 0;
+}
+
+static int orvibo_interface_find_name (const char *name) {
+    int i;
+    for (i = 0; i < InterfacesCount; ++i) {
+        if (!strcmp (Interfaces[i].name, name)) return i;
+    }
+    return -1;
+}
+
+static void orvibo_interface_enumerate (const char *list, int port) {
+
+    struct ifaddrs *interfaces;
+    struct ifaddrs *cursor;
+
+    if (getifaddrs (&interfaces) < 0) {
+        houselog_trace (HOUSE_FAILURE, "PLUG",
+                        "cannot list the interfaces: %s", strerror(errno));
+        return;
+    }
+    for (cursor = interfaces; cursor; cursor = cursor->ifa_next) {
+
+        if (!cursor->ifa_addr || cursor->ifa_addr->sa_family != AF_INET)
+            continue;
+        if (!(cursor->ifa_flags & IFF_UP)) continue;
+        if (!(cursor->ifa_flags & IFF_BROADCAST)) continue;
+        if (cursor->ifa_flags & IFF_LOOPBACK) continue;
+        if (!cursor->ifa_broadaddr || !cursor->ifa_netmask) continue;
+        if (!orvibo_interface_selected (list, cursor->ifa_name)) continue;
+
+        // An interface with several addresses is listed several times:
+        // only its first subnet is served.
+        //
+        if (orvibo_interface_find_name (cursor->ifa_name) >= 0) continue;
+
+        if (InterfacesCount >= ORVIBO_INTERFACE_MAX) {
+            houselog_trace (HOUSE_WARNING, "PLUG",
+                            "too many interfaces, %s ignored",
+                            cursor->ifa_name);
+            continue;
+        }
+        int s = orvibo_interface_open (cursor->ifa_name, port);
+        if (s < 0) continue;
+
+        struct OrviboInterface *f = Interfaces + InterfacesCount;
+        memset (f, 0, sizeof(*f));
+        snprintf (f->name, sizeof(f->name), "%s", cursor->ifa_name);
+        f->socket = s;
+        f->address = ((struct sockaddr_in *)(cursor->ifa_addr))->sin_addr.s_addr;
+        f->netmask = ((struct sockaddr_in *)(cursor->ifa_netmask))->sin_addr.s_addr;
+        f->broadcast = *((struct sockaddr_in *)(cursor->ifa_broadaddr));
+        f->broadcast.sin_family = AF_INET;
+        f->broadcast.sin_port = htons(10000);
+        InterfacesCount += 1;
+
+        char text[INET_ADDRSTRLEN];
+        inet_ntop (AF_INET, &(f->broadcast.sin_addr), text, sizeof(text));
+        houselog_trace (HOUSE_INFO, "PLUG",
+                        "interface %s, discovery broadcast to %s",
+                        f->name, text);
+    }
+    freeifaddrs (interfaces);
+}
+
+int orvibo_interface_initialize (int argc, const char **argv) {
+
+    int port = 10000;
+    const char *discovery = 0;
+    const char *list = 0;
+    const char *option;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-orvibo-port=", argv[i], &option))
+            port = atoi(option);
+        else if (echttp_option_match ("-orvibo-discovery=", argv[i], &option))
+            discovery = option;
+        else if (echttp_option_match ("-orvibo-interface=", argv[i], &option))
+            list = option;
+    }
+
+    if (list) {
+        orvibo_interface_enumerate (list, port);
+        if (InterfacesCount <= 0)
+            houselog_trace (HOUSE_WARNING, "PLUG",
+                            "no usable interface in %s, using all", list);
+    }
+
+    if (InterfacesCount <= 0) {
+        struct OrviboInterface *f = Interfaces;
+        memset (f, 0, sizeof(*f));
+        snprintf (f->name, sizeof(f->name), "any");
+        f->socket = orvibo_interface_open (0, port);
+        if (f->socket < 0) exit(1);
+        f->broadcast.sin_family = AF_INET;
+        f->broadcast.sin_addr.s_addr = INADDR_BROADCAST;
+        f->broadcast.sin_port = htons(10000);
+        InterfacesCount = 1;
+    }
+
+    if (discovery) {
+        for (i = 0; i < InterfacesCount; ++i)
+            orvibo_interface_discovery (discovery, &(Interfaces[i].broadcast));
+    }
+    return InterfacesCount;
+}
+
@@ -0,0 +1,46 @@
+/* orvibo - A simple home web server for world domination through Orvibo plugs.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * orvibo_interface.h - The UDP sockets, one per network interface.
+ *
+ */
+#define ORVIBO_INTERFACE_MAX 32
+
+#define ORVIBO_IF_RX_PACKETS  0
+#define ORVIBO_IF_RX_BYTES    1
+#define ORVIBO_IF_RX_DROPPED  2
+#define ORVIBO_IF_BROADCAST   3
+#define ORVIBO_IF_DETECTED    4
+#define ORVIBO_IF_COUNTERS    5
+
+int  orvibo_interface_initialize (int argc, const char **argv);
+
+int  orvibo_interface_count  (void);
+const char *orvibo_interface_name (int i);
+int  orvibo_interface_socket (int i);
+const struct sockaddr_in *orvibo_interface_broadcast (int i);
+
+int  orvibo_interface_find  (int fd);
+int  orvibo_interface_route (const struct sockaddr_in *a);
+
+void orvibo_interface_add (int i, int counter, long long value);
+
+int  orvibo_interface_export (char *buffer, int size);
+
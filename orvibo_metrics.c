@@ -0,0 +1,253 @@
+/* orvibo - A simple home web server for world domination through Orvibo plugs.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * orvibo_metrics.c - Counters and histograms for the hot paths.
+ *
+ * This module keeps a fixed set of counters and histograms, identified
+ * by the constants defined in orvibo_metrics.h. All storage is static:
+ * updating a metric never allocates, and only uses relaxed atomic
+ * additions, so that it is safe to call from any thread.
+ *
+ * SYNOPSYS:
+ *
+ * void orvibo_metrics_add (int counter, long long value);
+ *
+ *    Add the value to the specified counter.
+ *
+ * void orvibo_metrics_record (int histogram, long long value);
+ *
+ *    Record one sample in the specified histogram.
+ *
+ * long long orvibo_metrics_clock (void);
+ *
+ *    Return the current monotonic time in microseconds, to measure
+ *    the duration of an operation.
+ *
+ * int orvibo_metrics_export (char *buffer, int size);
+ *
+ *    Format all metrics using the Prometheus text format. Return the
+ *    length of the text, or -1 if the buffer is too small.
+ *
+ * const char *orvibo_metrics_label (const char *value,
+ *                                   char *buffer, int size);
+ *
+ *    Escape a label value for the Prometheus text format. The result
+ *    is stored in the buffer (truncated if too long), and returned.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "orvibo_metrics.h"
+
+struct MetricsCounter {
+    const char *name;
+    const char *label; // Optional, distinguishes counters of the same name.
+    const char *help;
+};
+
+static const struct MetricsCounter MetricsCounterName[ORVIBO_COUNTERS] = {
+    [ORVIBO_RX_PACKETS] = {"orvibo_rx_packets_total", 0,
+                           "UDP datagrams received"},
+    [ORVIBO_RX_BYTES] = {"orvibo_rx_bytes_total", 0,
+                         "UDP bytes received"},
+    [ORVIBO_RX_DROPPED] = {"orvibo_rx_dropped_total", 0,
+                           "UDP datagrams dropped by the kernel"},
+    [ORVIBO_RX_DISCOVERY] = {"orvibo_rx_parsed_total", "discovery",
+                             "UDP datagrams by parse outcome"},
+    [ORVIBO_RX_REPLY] = {"orvibo_rx_parsed_total", "reply", 0},
+    [ORVIBO_RX_IGNORED] = {"orvibo_rx_parsed_total", "ignored", 0},
+    [ORVIBO_RX_NEWPLUG] = {"orvibo_rx_parsed_total", "newplug", 0},
+    [ORVIBO_RX_SUBSCRIBED] = {"orvibo_rx_parsed_total", "subscribed", 0},
+    [ORVIBO_RX_CONTROLLED] = {"orvibo_rx_parsed_total", "controlled", 0},
+    [ORVIBO_RX_HEARTBEAT] = {"orvibo_rx_parsed_total", "heartbeat", 0},
+    [ORVIBO_RX_MALFORMED] = {"orvibo_rx_parsed_total", "malformed", 0},
+    [ORVIBO_TX_PACKETS] = {"orvibo_tx_packets_total", 0,
+                           "UDP datagrams sent"},
+    [ORVIBO_TX_BYTES] = {"orvibo_tx_bytes_total", 0,
+                         "UDP bytes sent"},
+    [ORVIBO_TX_ERRORS] = {"orvibo_tx_errors_total", 0,
+                          "UDP send errors"},
+    [ORVIBO_TX_SYSCALLS] = {"orvibo_tx_syscalls_total", 0,
+                            "sendmmsg() system calls"},
+    [ORVIBO_TX_BROADCAST] = {"orvibo_tx_discovery_total", "broadcast",
+                             "Discovery requests sent"},
+    [ORVIBO_TX_PROBE] = {"orvibo_tx_discovery_total", "probe", 0},
+    [ORVIBO_CMD_SENT] = {"orvibo_commands_total", "sent",
+                         "Plug commands by outcome"},
+    [ORVIBO_CMD_ACKED] = {"orvibo_commands_total", "acknowledged", 0},
+    [ORVIBO_CMD_RETRANSMIT] = {"orvibo_commands_total", "retransmitted", 0},
+    [ORVIBO_CMD_RETRY] = {"orvibo_commands_total", "retried", 0},
+    [ORVIBO_PLUG_DETECTED] = {"orvibo_plug_transitions_total", "detected",
+                              "Plug detection state transitions"},
+    [ORVIBO_PLUG_SILENT] = {"orvibo_plug_transitions_total", "silent", 0},
+    [ORVIBO_CONFIG_RELOAD] = {"orvibo_config_reloads_total", 0,
+                              "Configuration reloads"},
+    [ORVIBO_HTTP_STATUS] = {"orvibo_http_requests_total", "status",
+                            "HTTP requests by endpoint"},
+    [ORVIBO_HTTP_NOTMODIFIED] = {"orvibo_http_requests_total", "notmodified", 0},
+    [ORVIBO_HTTP_SET] = {"orvibo_http_requests_total", "set", 0},
+    [ORVIBO_EVENTS_LOGGED] = {"orvibo_events_total", "logged",
+                              "Device events by outcome"},
+    [ORVIBO_EVENTS_SUPPRESSED] = {"orvibo_events_total", "suppressed", 0},
+    [ORVIBO_RX_RINGFULL] = {"orvibo_rx_ring_dropped_total", 0,
+                            "UDP datagrams dropped because the ingest ring was full"},
+    [ORVIBO_TX_SUBSCRIBE] = {"orvibo_tx_subscriptions_total", 0,
+                             "Subscription frames sent"},
+    [ORVIBO_TX_SYSCALLS_SAVED] = {"orvibo_tx_syscalls_saved_total", 0,
+                                  "System calls saved by batching with sendmmsg()"},
+};
+
+#define ORVIBO_BUCKETS 12
+
+struct MetricsHistogram {
+    const char *name;
+    const char *help;
+    long long bound[ORVIBO_BUCKETS]; // Terminated by 0.
+};
+
+static const struct MetricsHistogram MetricsHistogramName[ORVIBO_HISTOGRAMS] = {
+    [ORVIBO_HIST_ACK_MS] =
+        {"orvibo_command_latency_milliseconds",
+         "Delay between a command and its acknowledgment",
+         {10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 0}},
+    [ORVIBO_HIST_RENDER_US] =
+        {"orvibo_status_render_microseconds",
+         "Time spent rendering the JSON status",
+         {50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000, 0}},
+    [ORVIBO_HIST_RENDER_BYTES] =
+        {"orvibo_status_size_bytes",
+         "Size of the JSON status",
+         {256, 1024, 4096, 16384, 65536, 262144, 1048576, 0}},
+    [ORVIBO_HIST_TXDELAY_MS] =
+        {"orvibo_tx_queue_delay_milliseconds",
+         "Time spent by the frames in the transmit queue",
+         {1, 5, 10, 50, 100, 500, 1000, 5000, 10000, 30000, 0}},
+    [ORVIBO_HIST_INGEST_US] =
+        {"orvibo_rx_ingest_latency_microseconds",
+         "Delay between the reception of a datagram and its processing",
+         {10, 50, 100, 250, 500, 1000, 2500, 10000, 50000, 250000, 0}},
+};
+
+static uint64_t MetricsCounters[ORVIBO_COUNTERS];
+
+static struct {
+    uint64_t bucket[ORVIBO_BUCKETS]; // The last one counts samples above.
+    uint64_t sum;
+} MetricsHistograms[ORVIBO_HISTOGRAMS];
+
+void orvibo_metrics_add (int counter, long long value) {
+    if (counter < 0 || counter >= ORVIBO_COUNTERS) return;
+    __atomic_fetch_add (MetricsCounters + counter, value, __ATOMIC_RELAXED);
+}
+
+void orvibo_metrics_record (int histogram, long long value) {
+
+    if (histogram < 0 || histogram >= ORVIBO_HISTOGRAMS) return;
+    const long long *bound = MetricsHistogramName[histogram].bound;
+
+    int i;
+    for (i = 0; i < ORVIBO_BUCKETS - 1 && bound[i]; ++i) {
+        if (value <= bound[i]) break;
+    }
+    __atomic_fetch_add (MetricsHistograms[histogram].bucket + i,
+                        1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&(MetricsHistograms[histogram].sum),
+                        value, __ATOMIC_RELAXED);
+}
+
+long long orvibo_metrics_clock (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+const char *orvibo_metrics_label (const char *value, char *buffer, int size) {
+
+    int length = 0;
+    for (; *value && length < size - 2; ++value) {
+        switch (*value) {
+            case '\\':
+            case '"':
+                buffer[length++] = '\\';
+                buffer[length++] = *value;
+                break;
+            case '\n':
+                buffer[length++] = '\\';
+                buffer[length++] = 'n';
+                break;
+            default:
+                buffer[length++] = *value;
+        }
+    }
+    buffer[length] = 0;
+    return buffer;
+}
+
+int orvibo_metrics_export (char *buffer, int size) {
+
+    int length = 0;
+    int i, j;
+
+#define METRICS_PRINT(...) \
+    { int l = snprintf (buffer + length, size - length, __VA_ARGS__); \
+      if (l >= size - length) return -1; \
+      length += l; }
+
+    for (i = 0; i < ORVIBO_COUNTERS; ++i) {
+        const struct MetricsCounter *c = MetricsCounterName + i;
+        uint64_t value = __atomic_load_n (MetricsCounters + i, __ATOMIC_RELAXED);
+        if (c->help) {
+            METRICS_PRINT ("# HELP %s %s\n# TYPE %s counter\n",
+                           c->name, c->help, c->name);
+        }
+        if (c->label) {
+            METRICS_PRINT ("%s{kind=\"%s\"} %llu\n",
+                           c->name, c->label, (unsigned long long)value);
+        } else {
+            METRICS_PRINT ("%s %llu\n", c->name, (unsigned long long)value);
+        }
+    }
+
+    for (i = 0; i < ORVIBO_HISTOGRAMS; ++i) {
+        const struct MetricsHistogram *h = MetricsHistogramName + i;
+        uint64_t cumulated = 0;
+        METRICS_PRINT ("# HELP %s %s\n# TYPE %s histogram\n",
+                       h->name, h->help, h->name);
+        for (j = 0; j < ORVIBO_BUCKETS; ++j) {
+            cumulated += __atomic_load_n (MetricsHistograms[i].bucket + j,
+                                          __ATOMIC_RELAXED);
+            if (j >= ORVIBO_BUCKETS - 1 || !h->bound[j]) break; // Overflow.
+            METRICS_PRINT ("%s_bucket{le=\"%lld\"} %llu\n",
+                           h->name, h->bound[j], (unsigned long long)cumulated);
+        }
+        METRICS_PRINT ("%s_bucket{le=\"+Inf\"} %llu\n",
+                       h->name, (unsigned long long)cumulated);
+        METRICS_PRINT ("%s_sum %llu\n%s_count %llu\n",
+                       h->name, (unsigned long long)
+                           __atomic_load_n (&(MetricsHistograms[i].sum),
+                                            __ATOMIC_RELAXED),
+                       h->name, (unsigned long long)cumulated);
+    }
+#undef METRICS_PRINT
+    return length;
+}
+
@@ -0,0 +1,72 @@
+/* orvibo - A simple home web server for world domination through Orvibo plugs.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * orvibo_metrics.h - Counters and histograms for the hot paths.
+ *
+ */
+#define ORVIBO_RX_PACKETS        0
+#define ORVIBO_RX_BYTES          1
+#define ORVIBO_RX_DROPPED        2
+#define ORVIBO_RX_DISCOVERY      3
+#define ORVIBO_RX_REPLY          4
+#define ORVIBO_RX_IGNORED        5
+#define ORVIBO_RX_NEWPLUG        6
+#define ORVIBO_RX_SUBSCRIBED     7
+#define ORVIBO_RX_CONTROLLED     8
+#define ORVIBO_RX_HEARTBEAT      9
+#define ORVIBO_RX_MALFORMED      10
+#define ORVIBO_TX_PACKETS        11
+#define ORVIBO_TX_BYTES          12
+#define ORVIBO_TX_ERRORS         13
+#define ORVIBO_TX_SYSCALLS       14
+#define ORVIBO_TX_BROADCAST      15
+#define ORVIBO_TX_PROBE          16
+#define ORVIBO_CMD_SENT          17
+#define ORVIBO_CMD_ACKED         18
+#define ORVIBO_CMD_RETRANSMIT    19
+#define ORVIBO_CMD_RETRY         20
+#define ORVIBO_PLUG_DETECTED     21
+#define ORVIBO_PLUG_SILENT       22
+#define ORVIBO_CONFIG_RELOAD     23
+#define ORVIBO_HTTP_STATUS       24
+#define ORVIBO_HTTP_NOTMODIFIED  25
+#define ORVIBO_HTTP_SET          26
+#define ORVIBO_EVENTS_LOGGED     27
+#define ORVIBO_EVENTS_SUPPRESSED 28
+#define ORVIBO_RX_RINGFULL       29
+#define ORVIBO_TX_SUBSCRIBE      30
+#define ORVIBO_TX_SYSCALLS_SAVED 31
+#define ORVIBO_COUNTERS          32
+
+#define ORVIBO_HIST_ACK_MS       0
+#define ORVIBO_HIST_RENDER_US    1
+#define ORVIBO_HIST_RENDER_BYTES 2
+#define ORVIBO_HIST_TXDELAY_MS   3
+#define ORVIBO_HIST_INGEST_US    4
+#define ORVIBO_HISTOGRAMS        5
+
+void orvibo_metrics_add    (int counter, long long value);
+void orvibo_metrics_record (int histogram, long long value);
+
+long long orvibo_metrics_clock (void);
+
+int orvibo_metrics_export (char *buffer, int size);
+const char *orvibo_metrics_label (const char *value, char *buffer, int size);
+
@@ -0,0 +1,341 @@
+/* orvibo - A simple home web server for control of orvibo WiFi plugs
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * orvibo_pacer.c - Paced transmission of the UDP frames.
+ *
+ * This module queues the frames to be sent to the plugs, and transmits
+ * them at a limited rate, using a token bucket, so that a large fan-out
+ * does not overflow the WiFi access points or the plugs. The frames
+ * are queued by priority class: the user commands go first, then the
+ * retries, then the health probes and discovery requests.
+ *
+ * The frames are sent in batches using sendmmsg(). When the bucket is
+ * empty, a timer is armed to resume the transmission once new tokens
+ * are available.
+ *
+ * SYNOPSYS:
+ *
+ * void orvibo_pacer_initialize (int argc, const char **argv);
+ *
+ *    Initialize the transmit queues. The following options are recognized:
+ *
+ *    -orvibo-rate=N    The maximum number of frames sent per second
+ *                      (default: 1000). 0 disables pacing.
+ *    -orvibo-burst=N   The maximum number of frames sent at once
+ *                      (default: 64).
+ *
+ * void orvibo_pacer_send (int priority, int fd, const struct sockaddr_in *a,
+ *                         const unsigned char *d, int length, int tag);
+ *
+ *    Queue one frame, to be sent through the specified UDP socket. The
+ *    frame and the destination are copied. All sockets share the same
+ *    rate limit, since they usually share the same WiFi access points.
+ *    If tag is not negative, the listener is called with that tag once
+ *    the frame was actually sent.
+ *
+ * void orvibo_pacer_on_sent (orvibo_pacer_listener *listener);
+ *
+ *    Declare the function to be called when a tagged frame was sent.
+ *
+ * void orvibo_pacer_flush (void);
+ *
+ *    Transmit as many queued frames as the rate allows. The rest is
+ *    transmitted later, without any further call.
+ *
+ * int orvibo_pacer_depth (int priority);
+ *
+ *    Return the number of frames waiting in the specified class.
+ *
+ * int orvibo_pacer_rate (void);
+ *
+ *    Return the configured rate, in frames per second, or 0 if unlimited.
+ */
+
+#define _GNU_SOURCE // For sendmmsg().
+
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+
+#include "echttp.h"
+#include "houselog.h"
+
+#include "orvibo_timer.h"
+#include "orvibo_metrics.h"
+#include "orvibo_pacer.h"
+
+#define ORVIBO_FRAMEMAX 32
+#define ORVIBO_TXBATCH 128
+
+struct PacerFrame {
+    long long queued;
+    int tag;
+    int socket;
+    struct sockaddr_in address;
+    int length;
+    unsigned char data[ORVIBO_FRAMEMAX];
+};
+
+// Each class is a ring of frames, which size is a power of 2. The ring
+// grows when full, so that no frame is ever dropped.
+//
+struct PacerQueue {
+    struct PacerFrame *ring;
+    int size;
+    int head;
+    int count;
+};
+
+static struct PacerQueue PacerQueues[ORVIBO_PACER_CLASSES];
+
+static int PacerTimer = -1;
+static int PacerArmed = 0;
+
+static int PacerRate = 1000;
+static int PacerBurst = 64;
+static double PacerTokens = 0;
+static long long PacerRefill = 0;
+
+static struct mmsghdr TxQueue[ORVIBO_TXBATCH];
+static struct iovec TxData[ORVIBO_TXBATCH];
+static struct PacerFrame TxFrame[ORVIBO_TXBATCH];
+
+static orvibo_pacer_listener *PacerListener = 0;
+
+void orvibo_pacer_on_sent (orvibo_pacer_listener *listener) {
+    PacerListener = listener;
+}
+
+static int orvibo_pacer_grow (struct PacerQueue *queue) {
+
+    int size = queue->size ? 2 * queue->size : 256;
+    struct PacerFrame *ring = malloc (size * sizeof(struct PacerFrame));
+    if (!ring) return 0;
+
+    int i;
+    for (i = 0; i < queue->count; ++i)
+        ring[i] = queue->ring[(queue->head + i) & (queue->size - 1)];
+    free (queue->ring);
+    queue->ring = ring;
+    queue->size = size;
+    queue->head = 0;
+    return 1;
+}
+
+void orvibo_pacer_send (int priority, int fd, const struct sockaddr_in *a,
+                        const unsigned char *d, int length, int tag) {
+
+    if (priority < 0 || priority >= ORVIBO_PACER_CLASSES) return;
+    if (length > ORVIBO_FRAMEMAX) return; // Never happens.
+
+    struct PacerQueue *queue = PacerQueues + priority;
+    if (queue->count >= queue->size) {
+        if (!orvibo_pacer_grow (queue)) {
+            houselog_trace (HOUSE_FAILURE, "PLUG", "no more memory");
+            return;
+        }
+    }
+    struct PacerFrame *frame =
+        queue->ring + ((queue->head + queue->count) & (queue->size - 1));
+    frame->queued = orvibo_timer_now ();
+    frame->tag = tag;
+    frame->socket = fd;
+    frame->address = *a;
+    frame->length = length;
+    memcpy (frame->data, d, length);
+    queue->count += 1;
+}
+
+// Take the next frames in priority order.
+//
+static int orvibo_pacer_dequeue (int limit, long long now) {
+
+    int count = 0;
+    int i;
+    for (i = 0; i < ORVIBO_PACER_CLASSES && count < limit; ++i) {
+        struct PacerQueue *queue = PacerQueues + i;
+        while (queue->count > 0 && count < limit) {
+            struct PacerFrame *frame = TxFrame + count;
+            *frame = queue->ring[queue->head];
+            queue->head = (queue->head + 1) & (queue->size - 1);
+            queue->count -= 1;
+            orvibo_metrics_record (ORVIBO_HIST_TXDELAY_MS, now - frame->queued);
+
+            TxData[count].iov_base = frame->data;
+            TxData[count].iov_len = frame->length;
+            struct msghdr *h = &(TxQueue[count].msg_hdr);
+            memset (h, 0, sizeof(*h));
+            h->msg_name = &(frame->address);
+            h->msg_namelen = sizeof(struct sockaddr_in);
+            h->msg_iov = TxData + count;
+            h->msg_iovlen = 1;
+            count += 1;
+        }
+    }
+    return count;
+}
+
+static void orvibo_pacer_transmit (int count, long long now) {
+
+    int start = 0;
+    int calls = 0;
+
+    while (start < count) {
+        // A single sendmmsg() call per run of frames for the same socket.
+        int fd = TxFrame[start].socket;
+        int end = start + 1;
+        while (end < count && TxFrame[end].socket == fd) end += 1;
+
+        int sent = sendmmsg (fd, TxQueue + start, end - start, 0);
+        calls += 1;
+        if (sent <= 0) {
+            houselog_trace
+                (HOUSE_FAILURE, "PLUG", "sendmmsg() error: %s", strerror(errno));
+            orvibo_metrics_add (ORVIBO_TX_ERRORS, 1);
+            start += 1; // Skip the frame that failed.
+            continue;
+        }
+        int i;
+        long long bytes = 0;
+        for (i = start; i < start + sent; ++i) {
+            bytes += TxQueue[i].msg_len;
+            if (TxFrame[i].tag >= 0 && PacerListener)
+                PacerListener (TxFrame[i].tag, now);
+        }
+        orvibo_metrics_add (ORVIBO_TX_PACKETS, sent);
+        orvibo_metrics_add (ORVIBO_TX_BYTES, bytes);
+        start += sent;
+    }
+    orvibo_metrics_add (ORVIBO_TX_SYSCALLS, calls);
+    if (count > calls)
+        orvibo_metrics_add (ORVIBO_TX_SYSCALLS_SAVED, count - calls);
+    if (echttp_isdebug() && count > 0)
+        fprintf (stderr, "flushed %d frames in %d calls\n", count, calls);
+}
+
+static int orvibo_pacer_pending (void) {
+    int i;
+    int count = 0;
+    for (i = 0; i < ORVIBO_PACER_CLASSES; ++i) count += PacerQueues[i].count;
+    return count;
+}
+
+static void orvibo_pacer_arm (long long delay) {
+
+    struct itimerspec timer;
+    memset (&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = delay / 1000;
+    timer.it_value.tv_nsec = (delay % 1000) * 1000000;
+    if (timerfd_settime (PacerTimer, 0, &timer, 0) < 0) {
+        houselog_trace (HOUSE_FAILURE, "PLUG",
+                        "timerfd_settime() error: %s", strerror(errno));
+        return;
+    }
+    PacerArmed = 1;
+}
+
+void orvibo_pacer_flush (void) {
+
+    long long now = orvibo_timer_now ();
+
+    if (PacerRate <= 0) {
+        int count;
+        while ((count = orvibo_pacer_dequeue (ORVIBO_TXBATCH, now)) > 0)
+            orvibo_pacer_transmit (count, now);
+        return;
+    }
+
+    PacerTokens += ((now - PacerRefill) * PacerRate) / 1000.0;
+    if (PacerTokens > PacerBurst) PacerTokens = PacerBurst;
+    PacerRefill = now;
+
+    while (PacerTokens >= 1) {
+        int limit = (int)PacerTokens;
+        if (limit > ORVIBO_TXBATCH) limit = ORVIBO_TXBATCH;
+        int count = orvibo_pacer_dequeue (limit, now);
+        if (count <= 0) break;
+        orvibo_pacer_transmit (count, now);
+        PacerTokens -= count;
+    }
+
+    // Resume when enough tokens are available for a batch, or at least
+    // for the next frame.
+    //
+    if (orvibo_pacer_pending() > 0 && !PacerArmed) {
+        int needed = orvibo_pacer_pending();
+        if (needed > PacerBurst) needed = PacerBurst;
+        long long delay = (long long)(((needed - PacerTokens) * 1000) / PacerRate);
+        if (delay < 1) delay = 1;
+        orvibo_pacer_arm (delay);
+    }
+}
+
+static void orvibo_pacer_wakeup (int fd, int mode) {
+    uint64_t expirations;
+    if (read (fd, &expirations, sizeof(expirations)) < 0) return;
+    PacerArmed = 0;
+    orvibo_pacer_flush ();
+}
+
+int orvibo_pacer_depth (int priority) {
+    if (priority < 0 || priority >= ORVIBO_PACER_CLASSES) return 0;
+    return PacerQueues[priority].count;
+}
+
+int orvibo_pacer_rate (void) {
+    return PacerRate;
+}
+
+void orvibo_pacer_initialize (int argc, const char **argv) {
+
+    const char *option;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-orvibo-rate=", argv[i], &option))
+            PacerRate = atoi(option);
+        else if (echttp_option_match ("-orvibo-burst=", argv[i], &option))
+            PacerBurst = atoi(option);
+    }
+    if (PacerBurst < 1) PacerBurst = 1;
+
+    PacerTokens = PacerBurst;
+    PacerRefill = orvibo_timer_now ();
+
+    PacerTimer = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (PacerTimer < 0) {
+        houselog_trace (HOUSE_FAILURE, "PLUG",
+                        "cannot create timer: %s", strerror(errno));
+        exit(1);
+    }
+    echttp_listen (PacerTimer, 1, orvibo_pacer_wakeup, 0);
+
+    if (PacerRate > 0)
+        houselog_trace (HOUSE_INFO, "PLUG",
+                        "transmit rate %d frames/s, burst %d", PacerRate, PacerBurst);
+}
+
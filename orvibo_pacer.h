@@ -0,0 +1,40 @@
+/* orvibo - A simple home web server for world domination through Orvibo plugs.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * orvibo_pacer.h - Paced transmission of the UDP frames.
+ *
+ */
+#define ORVIBO_PACER_COMMAND 0 // User commands.
+#define ORVIBO_PACER_RETRY   1 // Retransmissions and retries.
+#define ORVIBO_PACER_PROBE   2 // Health probes and discovery.
+#define ORVIBO_PACER_CLASSES 3
+
+void orvibo_pacer_initialize (int argc, const char **argv);
+
+void orvibo_pacer_send  (int priority, int fd, const struct sockaddr_in *a,
+                         const unsigned char *d, int length, int tag);
+
+typedef void orvibo_pacer_listener (int tag, long long now);
+void orvibo_pacer_on_sent (orvibo_pacer_listener *listener);
+void orvibo_pacer_flush (void);
+
+int  orvibo_pacer_depth (int priority);
+int  orvibo_pacer_rate  (void);
+
@@ -24,7 +24,29 @@
  *
  * void orvibo_plug_initialize (int argc, const char **argv, int livestate);
  *
- *    Initialize the access to the Orvibo plugs.
+ *    Initialize the access to the Orvibo plugs. The following options
+ *    are recognized:
+ *
+ *    -orvibo-interface=all|NAME[,NAME..]
+ *                                Discover and control the plugs through
+ *                                each of these network interfaces.
+ *    -orvibo-port=PORT           The local UDP port (default: 10000).
+ *    -orvibo-discovery=HOST[:PORT]
+ *                                Where to send the discovery requests
+ *                                (default: broadcast on port 10000).
+ *
+ *    See orvibo_interface.c for details. The last two options are mostly
+ *    meant to run against the orviboemu emulator.
+ *
+ *    -orvibo-snapshot=PATH       Where to save the state of the plugs
+ *                                (see orvibo_snapshot.c), so that it is
+ *                                restored when the service restarts.
+ *    -orvibo-subscription=N      How long a subscription is trusted, in
+ *                                seconds (default: 240).
+ *    -orvibo-ingest=inline|thread
+ *                                Receive the datagrams in the main loop,
+ *                                or in a separate thread (see
+ *                                orvibo_ingest.c).
  *
  * const char *orvibo_plug_configure (int argc, const char **argv);
  *
@@ -33,19 +55,37 @@
  *
  * const char *orvibo_plug_refresh (void);
  *
- *    Re-evaluate the GPIO setup after the configuration changed.
+ *    Re-evaluate the plugs setup after the configuration changed. Only
+ *    the plugs that were added, removed or modified are affected. The
+ *    plugs discovered on the network that were never configured are kept.
  *
  * int orvibo_plug_count (void);
  *
- *    Return the number of configured relay points available.
+ *    Return the number of configured relay points available. This
+ *    includes the free slots left by removed plugs, which have an
+ *    empty name.
+ *
+ * int orvibo_plug_capacity (void);
+ *
+ *    Return the number of plugs that the registry can hold without
+ *    allocating more memory.
  *
  * const char *orvibo_plug_name (int point);
  *
  *    Return the name of an orvibo plug.
  *
+ * int orvibo_plug_search (const char *name);
+ * int orvibo_plug_search_next (const char *name, int after);
+ *
+ *    Return the point index of the named plug, or -1 if not found.
+ *    Several plugs may have the same name: orvibo_plug_search_next()
+ *    returns the next plug with that name after the specified point.
+ *
  * const char *orvibo_plug_failure (int point);
  *
  *    Return a string describing the failure, or a null pointer if healthy.
+ *    A plug is "silent" when it does not answer the health probes, and
+ *    "unreachable" when it answers but does not obey the commands.
  *
  * int    orvibo_plug_commanded (int point);
  * time_t orvibo_plug_deadline (int point);
@@ -53,10 +93,34 @@
  *    Return the last commanded state, or the command deadline, for
  *    the specified orvibo plug.
  *
+ * int orvibo_plug_version (int point);
+ *
+ *    Return the live state version at which this plug last changed.
+ *
+ * int orvibo_plug_horizon (void);
+ *
+ *    Return the oldest live state version for which the changes are
+ *    fully tracked. A client that knows an older version must reload
+ *    the complete status.
+ *
+ * const char *orvibo_plug_removed (int since, int *cursor);
+ *
+ *    Enumerate the names of the plugs removed after the specified version.
+ *    The cursor must be initialized to 0. Return 0 when done. Note that
+ *    a removed name might have been added again later: removals must be
+ *    applied before changes.
+ *
  * int orvibo_plug_get (int point);
  *
  *    Get the actual state of the plug.
  *
+ * int orvibo_plug_latency (int point, int *p50, int *p99, int *max);
+ *
+ *    Return the number of acknowledged commands for this plug, and the
+ *    50th and 99th percentiles and the maximum of the command latency,
+ *    in milliseconds. The percentiles are the upper bound of the
+ *    histogram bucket (powers of 2).
+ *
  * int orvibo_plug_set (int point, int state, int pulse);
  *
  *    Set the specified point to the on (1) or off (0) state for the pulse
@@ -65,17 +129,72 @@
  *
  *    Return 1 on success, 0 if the plug is not known and -1 on error.
  *
+ *    The command frames are only queued: call orvibo_plug_flush() once
+ *    all the plugs have been set.
+ *
+ * void orvibo_plug_flush (void);
+ *
+ *    Transmit the queued frames, at the rate allowed by the transmit
+ *    pacer (see orvibo_pacer.c).
+ *
  * void orvibo_plug_periodic (void);
  *
  *    This function must be called every second. It runs the Orvibo plug
- *    discovery and ends the expired pulses.
+ *    discovery. The pulses, retries and health probes are driven by
+ *    timers (see orvibo_timer.c), independently of this function.
+ *
+ * HEALTH PROBES
+ *
+ *    Once a plug has been detected, it is probed individually by sending
+ *    a single plug discovery request (qg), addressed to its MAC, to its
+ *    last known IP address. The probe interval adapts to the plug's reply
+ *    jitter: a plug that answers consistently is probed less often. Each
+ *    probe is scheduled with a random offset, so that the replies are
+ *    spread evenly over time. The probes of all plugs may use only a
+ *    quarter of the transmit rate, which sets the shortest interval for
+ *    large fleets. A probe is skipped while the previous one is still
+ *    waiting to be transmitted.
+ *
+ *    The plug's health is evaluated using an accrual suspicion score
+ *    (phi = -log10 of the probability that the reply is merely late),
+ *    based on the observed round trip time distribution. A plug is
+ *    declared silent when the score crosses a threshold after several
+ *    unanswered probes, or in any case after 90 seconds without any reply
+ *    (longer for large fleets). The probe time is when the probe was
+ *    actually transmitted. The RTT is only sampled from the replies to the
+ *    most recent probe, and a default RTT is assumed until the first
+ *    sample. The broadcast discovery is only used to find unknown plugs:
+ *    it slows down once all configured plugs have been detected.
+ *
+ * COMMAND ACKNOWLEDGMENT
+ *
+ *    Each command sent to a plug is numbered, and remains outstanding until
+ *    the plug reports the commanded state. The delay until that report is
+ *    recorded in a per-plug latency histogram. If the report is overdue
+ *    (based on the plug's RTT), the command is retransmitted immediately,
+ *    with an exponential backoff, instead of waiting for the retry timer.
+ *    Every frame from the plug that reports its state counts: the reply
+ *    to the discovery or to the subscription, or a state report. The
+ *    reply to the command does not count, since it cannot be told apart
+ *    from the command itself.
+ *
+ * SUBSCRIPTIONS
+ *
+ *    A plug only obeys the clients that subscribed recently. The time
+ *    when the plug confirmed the subscription is recorded, so that a
+ *    command is sent as a single control frame while the subscription
+ *    is valid. A new subscription is sent first when the previous one
+ *    may have expired, when the plug changed address or went silent, or
+ *    when a command was not acknowledged (i.e. probably rejected).
  */
 
 #include <time.h>
+#include <math.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
 
 #include <sys/socket.h>
@@ -89,90 +208,384 @@
 #include "housestate.h"
 
 #include "orvibo_plug.h"
+#include "orvibo_timer.h"
+#include "orvibo_metrics.h"
+#include "orvibo_scene.h"
+#include "orvibo_pacer.h"
+#include "orvibo_interface.h"
+#include "orvibo_ingest.h"
+#include "orvibo_event.h"
+#include "orvibo_snapshot.h"
+
+#define ORVIBO_LATENCY_BUCKETS 16
 
 struct PlugMap {
     char name[32];
     char description[256];
     char macaddress[16];
+    uint64_t mac;
+    unsigned char probe[18];
+    unsigned char subscribe[30];
+    unsigned char control[2][23]; // Off, on.
+    int nextbymac;
+    int nextbyname;
     struct sockaddr_in ipaddress;
+    int interface;       // Through which the plug was last seen.
     time_t detected;
+    long long lastseen; // Monotonic time (ms).
+    long long probesent; // Oldest unanswered probe, 0 if none.
+    long long probelast; // Most recent unanswered probe, 0 if none.
+    int probequeued;     // A probe is waiting in the transmit pacer.
+    int missed;
+    double rttmean;      // ms
+    double rttvariance;
+    long long subscribed;   // When the subscription was confirmed, 0 if none.
+    int sequence;           // Number of the last command sent.
+    long long commandsent;  // Time of the outstanding command, 0 if none.
+    int retransmits;
+    int retries;            // Since the last command or convergence.
+    int unreachable;
+    unsigned int latency[ORVIBO_LATENCY_BUCKETS]; // Log2 buckets, in ms.
+    int latencymax;
     int status;
     int commanded;
     time_t deadline;
+    int version;
+    int configured;
+    int discovered;      // Added from the network, not from the config.
+    int resumed;         // Restored from the snapshot, state not seen yet.
 };
 
-static struct PlugMap *Plugs;
-static int PlugsCount = 0;
+// The plug registry is a set of fixed size slabs, allocated on demand
+// and never moved or freed: a plug index is a stable handle, and a pointer
+// to a plug remains valid for the life of the process. The slabs are
+// reused when the configuration is reloaded.
+//
+#define ORVIBO_SLAB_SHIFT 8
+#define ORVIBO_SLAB_SIZE  (1 << ORVIBO_SLAB_SHIFT)
+#define ORVIBO_SLAB_MASK  (ORVIBO_SLAB_SIZE - 1)
+#define ORVIBO_SLABS_MAX  256 // i.e. 65536 plugs.
+
+static struct PlugMap *PlugsSlabs[ORVIBO_SLABS_MAX];
+static int PlugsSlabsCount = 0;
+
+#define PLUG(i) (PlugsSlabs[(i) >> ORVIBO_SLAB_SHIFT] + ((i) & ORVIBO_SLAB_MASK))
+
+static int PlugsCount = 0; // Includes the free slots.
 static int PlugsSpace = 0;
 
-static int OrviboSocket = -1;
-static struct sockaddr_in OrviboBroadcast;
+// The free slots left by removed plugs are reused first.
+//
+static int *PlugsFree = 0;
+static int PlugsFreeCount = 0;
+static int PlugsFreeSpace = 0;
+
+// Hash indexes of the plugs by MAC address and by name. Each bucket
+// is the head of a chain linked through the PlugMap nextbymac and
+// nextbyname fields (-1 terminates the chain). The number of buckets
+// is a power of 2, sized from PlugsSpace: the index is rebuilt only when
+// the registry grows.
+//
+static int *PlugsByMac = 0;
+static int *PlugsByName = 0;
+static int PlugsHashSize = 0;
 
 static int LiveState = 0;
 
+// Each plug has its own set of timers. The timer ID combines the plug
+// index and the timer kind.
+//
+#define ORVIBO_TIMER_PULSE   0
+#define ORVIBO_TIMER_RETRY   1
+#define ORVIBO_TIMER_PROBE   2
+#define ORVIBO_TIMER_ACK     3
+#define ORVIBO_TIMER_KINDS   4
+
+#define ORVIBO_TIMER_ID(plug,kind) ((plug) * ORVIBO_TIMER_KINDS + (kind))
+
+#define ORVIBO_RETRY_PERIOD   5000  // ms, first retry.
+#define ORVIBO_RETRY_CAP      300000 // ms, longest delay between retries.
+#define ORVIBO_RETRY_LIMIT    6     // Then the plug is unreachable.
+
+#define ORVIBO_PROBE_MIN      1000  // ms
+#define ORVIBO_PROBE_MAX      10000 // ms
+#define ORVIBO_JITTER_REF     50.0  // ms, halves the probe interval.
+#define ORVIBO_JITTER_MIN     100.0 // ms, floor of the RTT deviation.
+#define ORVIBO_PROBE_MISSES   3
+#define ORVIBO_PHI_THRESHOLD  8.0
+#define ORVIBO_RTT_DEFAULT    500.0 // ms, until the first RTT sample.
+#define ORVIBO_SILENT_MAX     90000 // ms, silent whatever the suspicion.
+#define ORVIBO_PROBE_SHARE    4     // Probes use 1/4 of the transmit rate.
+
+#define ORVIBO_ACK_MIN        250   // ms
+#define ORVIBO_ACK_MAX        2000  // ms
+#define ORVIBO_ACK_RETRANSMIT 3
+
+// An S20 plug only obeys the clients that subscribed, and forgets them
+// after a few minutes. The subscription is renewed slightly before that.
+//
+#define ORVIBO_SUBSCRIPTION   240   // s, default subscription lifetime.
+
+static long long PlugsSubscription = ORVIBO_SUBSCRIPTION * 1000LL; // ms
+
+#define ORVIBO_SENSE_FAST     30    // s, while some plugs are missing.
+#define ORVIBO_SENSE_SLOW     300   // s, to find new plugs.
+
+// Names of the plugs that were removed, with the version of the removal.
+// This is a ring: the oldest removals are forgotten, which moves the
+// horizon of the versions for which the changes are fully known.
+//
+#define ORVIBO_TOMBSTONES 256
+
+struct PlugTombstone {
+    char name[32];
+    int version;
+};
+
+static struct PlugTombstone PlugsRemoved[ORVIBO_TOMBSTONES];
+static int PlugsRemovedCount = 0;
+static int PlugsHorizon = 0;
+
 int orvibo_plug_count (void) {
     return PlugsCount;
 }
 
+int orvibo_plug_capacity (void) {
+    return PlugsSpace;
+}
+
 const char *orvibo_plug_name (int point) {
-    if (point < 0 || point > PlugsCount) return 0;
-    return Plugs[point].name;
+    if (point < 0 || point >= PlugsCount) return 0;
+    return PLUG(point)->name;
 }
 
-int orvibo_plug_commanded (int point) {
-    if (point < 0 || point > PlugsCount) return 0;
-    return Plugs[point].commanded;
+static unsigned int orvibo_plug_hash_mac (uint64_t mac) {
+    mac ^= mac >> 29;
+    mac *= 0xbf58476d1ce4e5b9ULL;
+    mac ^= mac >> 32;
+    return (unsigned int)mac & (PlugsHashSize - 1);
 }
 
-time_t orvibo_plug_deadline (int point) {
-    if (point < 0 || point > PlugsCount) return 0;
-    return Plugs[point].deadline;
+static unsigned int orvibo_plug_hash_name (const char *name) {
+    unsigned int hash = 2166136261U; // FNV-1a.
+    while (*name) {
+        hash ^= (unsigned char)(*(name++));
+        hash *= 16777619U;
+    }
+    return hash & (PlugsHashSize - 1);
 }
 
-const char *orvibo_plug_failure (int point) {
-    if (point < 0 || point > PlugsCount) return 0;
-    if (!Plugs[point].detected) return "silent";
+static void orvibo_plug_index (int plug) {
+    unsigned int bucket;
+    if (PLUG(plug)->mac) {
+        bucket = orvibo_plug_hash_mac (PLUG(plug)->mac);
+        PLUG(plug)->nextbymac = PlugsByMac[bucket];
+        PlugsByMac[bucket] = plug;
+    }
+    if (PLUG(plug)->name[0]) {
+        bucket = orvibo_plug_hash_name (PLUG(plug)->name);
+        PLUG(plug)->nextbyname = PlugsByName[bucket];
+        PlugsByName[bucket] = plug;
+    }
+}
+
+static const char *orvibo_plug_index_reset (void) {
+    int size = 16;
+    while (size < 2 * PlugsSpace) size *= 2;
+    if (size != PlugsHashSize) {
+        free (PlugsByMac);
+        free (PlugsByName);
+        PlugsByMac = malloc (size * sizeof(int));
+        PlugsByName = malloc (size * sizeof(int));
+        if (!PlugsByMac || !PlugsByName) {
+            PlugsHashSize = 0;
+            return "no more memory";
+        }
+        PlugsHashSize = size;
+    }
+    memset (PlugsByMac, 0xff, size * sizeof(int)); // All -1.
+    memset (PlugsByName, 0xff, size * sizeof(int));
     return 0;
 }
 
-int orvibo_plug_get (int point) {
-    if (point < 0 || point > PlugsCount) return 0;
-    return Plugs[point].status;
+static const char *orvibo_plug_grow (int needed) {
+
+    int i;
+
+    if (needed <= PlugsSpace) return 0;
+
+    while (PlugsSpace < needed) {
+        if (PlugsSlabsCount >= ORVIBO_SLABS_MAX) return "too many plugs";
+        struct PlugMap *slab = calloc (ORVIBO_SLAB_SIZE, sizeof(struct PlugMap));
+        if (!slab) return "no more memory";
+        PlugsSlabs[PlugsSlabsCount++] = slab;
+        PlugsSpace += ORVIBO_SLAB_SIZE;
+    }
+    houselog_trace (HOUSE_INFO, "PLUG",
+                    "registry capacity is now %d plugs (%d used)",
+                    PlugsSpace, PlugsCount);
+
+    if (2 * PlugsSpace > PlugsHashSize) {
+        const char *error = orvibo_plug_index_reset ();
+        if (error) return error;
+        for (i = 0; i < PlugsCount; ++i) orvibo_plug_index (i);
+    }
+    return 0;
+}
+
+static void orvibo_plug_unindex (int plug) {
+    int *cursor;
+    if (!PlugsHashSize) return;
+    if (PLUG(plug)->mac) {
+        cursor = PlugsByMac + orvibo_plug_hash_mac (PLUG(plug)->mac);
+        while (*cursor >= 0 && *cursor != plug) cursor = &(PLUG(*cursor)->nextbymac);
+        if (*cursor == plug) *cursor = PLUG(plug)->nextbymac;
+    }
+    if (PLUG(plug)->name[0]) {
+        cursor = PlugsByName + orvibo_plug_hash_name (PLUG(plug)->name);
+        while (*cursor >= 0 && *cursor != plug) cursor = &(PLUG(*cursor)->nextbyname);
+        if (*cursor == plug) *cursor = PLUG(plug)->nextbyname;
+    }
+}
+
+static int orvibo_plug_allocate (void) {
+    if (PlugsFreeCount > 0) return PlugsFree[--PlugsFreeCount];
+    if (orvibo_plug_grow (PlugsCount + 1)) return -1;
+    return PlugsCount++;
 }
 
-static void orvibo_plug_socket (void) {
+static void orvibo_plug_release (int plug) {
+    if (PlugsFreeCount >= PlugsFreeSpace) {
+        int space = PlugsFreeSpace ? PlugsFreeSpace * 2 : 64;
+        int *list = realloc (PlugsFree, space * sizeof(int));
+        if (!list) return; // The slot is lost, not a big deal.
+        PlugsFree = list;
+        PlugsFreeSpace = space;
+    }
+    PlugsFree[PlugsFreeCount++] = plug;
+}
 
-    static int OrviboPort = 10000;
+int orvibo_plug_search_next (const char *name, int after) {
+    if (!PlugsHashSize) return -1;
+    int plug = (after >= 0) ? PLUG(after)->nextbyname
+                            : PlugsByName[orvibo_plug_hash_name (name)];
+    while (plug >= 0) {
+        if (!strcmp (name, PLUG(plug)->name)) return plug;
+        plug = PLUG(plug)->nextbyname;
+    }
+    return -1;
+}
 
-    OrviboBroadcast.sin_family = AF_INET;
-    OrviboBroadcast.sin_port = htons(OrviboPort);
-    OrviboBroadcast.sin_addr.s_addr = INADDR_ANY;
+int orvibo_plug_search (const char *name) {
+    return orvibo_plug_search_next (name, -1);
+}
 
-    OrviboSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (OrviboSocket < 0) {
-        houselog_trace (HOUSE_FAILURE, "PLUG",
-                        "cannot open UDP socket: %s", strerror(errno));
-        exit(1);
+static int orvibo_plug_mac_search (uint64_t mac) {
+    if (!PlugsHashSize) return -1;
+    int plug = PlugsByMac[orvibo_plug_hash_mac (mac)];
+    while (plug >= 0) {
+        if (PLUG(plug)->mac == mac) return plug;
+        plug = PLUG(plug)->nextbymac;
     }
+    return -1;
+}
 
-    if (bind(OrviboSocket,
-             (struct sockaddr *)(&OrviboBroadcast),
-             sizeof(OrviboBroadcast)) < 0) {
-        houselog_trace (HOUSE_FAILURE, "PLUG",
-                        "cannot bind to UDP port %d: %s",
-                        OrviboPort, strerror(errno));
-        exit(1);
+int orvibo_plug_version (int point) {
+    if (point < 0 || point >= PlugsCount) return 0;
+    return PLUG(point)->version;
+}
+
+int orvibo_plug_horizon (void) {
+    return PlugsHorizon;
+}
+
+const char *orvibo_plug_removed (int since, int *cursor) {
+    int first = PlugsRemovedCount - ORVIBO_TOMBSTONES;
+    if (first < 0) first = 0;
+    if (*cursor < first) *cursor = first;
+    while (*cursor < PlugsRemovedCount) {
+        struct PlugTombstone *t = PlugsRemoved + (*cursor % ORVIBO_TOMBSTONES);
+        *cursor += 1;
+        if (t->version > since) return t->name;
     }
+    return 0;
+}
+
+static void orvibo_plug_tombstone (const char *name, int version) {
+    struct PlugTombstone *t =
+        PlugsRemoved + (PlugsRemovedCount % ORVIBO_TOMBSTONES);
+    if (PlugsRemovedCount >= ORVIBO_TOMBSTONES) PlugsHorizon = t->version;
+    snprintf (t->name, sizeof(t->name), "%s", name);
+    t->version = version;
+    PlugsRemovedCount += 1;
+}
+
+// Save the state of the plug, so that it can be restored after a restart.
+//
+static void orvibo_plug_save (int plug) {
+    const struct PlugMap *p = PLUG(plug);
+    if (!p->mac) return; // Cannot be matched after a restart.
+    struct OrviboSnapshot record;
+    memset (&record, 0, sizeof(record));
+    record.mac = p->mac;
+    record.address = p->ipaddress.sin_addr.s_addr;
+    record.port = p->ipaddress.sin_port;
+    record.commanded = p->commanded;
+    record.status = p->status;
+    record.deadline = p->deadline;
+    orvibo_snapshot_update (plug, &record);
+}
+
+static void orvibo_plug_changed (int plug) {
+    orvibo_plug_save (plug);
+    housestate_changed (LiveState);
+    PLUG(plug)->version = housestate_current (LiveState);
+}
 
-    int value = 1;
-    if (setsockopt(OrviboSocket, SOL_SOCKET, SO_BROADCAST, &value, sizeof(value)) < 0) {
-        houselog_trace (HOUSE_FAILURE, "PLUG",
-                        "cannot broadcast: %s", strerror(errno));
-        exit(1);
+int orvibo_plug_commanded (int point) {
+    if (point < 0 || point >= PlugsCount) return 0;
+    return PLUG(point)->commanded;
+}
+
+time_t orvibo_plug_deadline (int point) {
+    if (point < 0 || point >= PlugsCount) return 0;
+    return PLUG(point)->deadline;
+}
+
+const char *orvibo_plug_failure (int point) {
+    if (point < 0 || point >= PlugsCount) return 0;
+    if (!PLUG(point)->detected) return "silent";
+    if (PLUG(point)->unreachable) return "unreachable";
+    return 0;
+}
+
+int orvibo_plug_latency (int point, int *p50, int *p99, int *max) {
+
+    if (point < 0 || point >= PlugsCount) return 0;
+    const struct PlugMap *p = PLUG(point);
+
+    int total = 0;
+    int i;
+    for (i = 0; i < ORVIBO_LATENCY_BUCKETS; ++i) total += p->latency[i];
+
+    int target50 = (total + 1) / 2;
+    int target99 = (total * 99 + 99) / 100;
+    int cumulated = 0;
+    *p50 = *p99 = 0;
+    for (i = 0; i < ORVIBO_LATENCY_BUCKETS; ++i) {
+        int bound = 1 << i;
+        if (bound > p->latencymax) bound = p->latencymax;
+        cumulated += p->latency[i];
+        if (!*p50 && cumulated >= target50 && total) *p50 = bound;
+        if (!*p99 && cumulated >= target99 && total) *p99 = bound;
     }
-    OrviboBroadcast.sin_addr.s_addr = INADDR_BROADCAST;
-    houselog_trace (HOUSE_INFO, "PLUG",
-                    "UDP port %d is now open", OrviboPort);
+    *max = p->latencymax;
+    return total;
+}
+
+int orvibo_plug_get (int point) {
+    if (point < 0 || point >= PlugsCount) return 0;
+    return PLUG(point)->status;
 }
 
 static unsigned char hex2bin(char data) {
@@ -192,202 +605,659 @@ static char bin2hex (unsigned char d) {
     return '0';
 }
 
-static void orvibo_plug_send (const struct sockaddr_in *a, const char *d) {
-    if (echttp_isdebug())
-        printf ("Sending %s%s\n", d, (a==&OrviboBroadcast)?" (broadcast)":"");
-    static unsigned char buffer[1500];
+// Pack a MAC address as a 48-bit integer, in network order.
+//
+static uint64_t orvibo_plug_mac_pack (const unsigned char *data) {
+    uint64_t mac = 0;
+    int i;
+    for (i = 0; i < 6; ++i) mac = (mac << 8) | data[i];
+    return mac;
+}
+
+static uint64_t orvibo_plug_mac_parse (const char *text) {
+    unsigned char data[6];
     int i;
-    for (i = 0; d[i] != 0; i += 2) {
-        buffer[i/2] = hex2bin(d[i]) * 16 + hex2bin(d[i+1]);
+    for (i = 0; i < 6; ++i) {
+        if (!text[2*i] || !text[2*i+1]) return 0;
+        data[i] = hex2bin(text[2*i]) * 16 + hex2bin(text[2*i+1]);
     }
-    int sent = sendto (OrviboSocket, buffer, i/2, 0,
-                       (struct sockaddr *)a, sizeof(struct sockaddr_in));
-    if (sent < 0)
-        houselog_trace
-            (HOUSE_FAILURE, "PLUG", "sendto() error: %s", strerror(errno));
+    return orvibo_plug_mac_pack (data);
 }
 
-static void orvibo_plug_sense (void) {
-    orvibo_plug_send (&OrviboBroadcast, "686400067161");
+static void orvibo_plug_dump (const char *label,
+                              const unsigned char *d, int l) {
+    char buffer[256];
+    int i, j;
+
+    if (l >= sizeof(buffer) / 2) l = (sizeof(buffer) / 2) - 1;
+    buffer[l*2] = 0;
+    for (i = l-1, j = (l-1)*2; i >= 0; --i, j -= 2) {
+        buffer[j] = bin2hex(d[i]>>4);
+        buffer[j+1] = bin2hex(d[i]);
+    }
+    fprintf (stderr, "%s: %s\n", label, buffer);
 }
 
-static void orvibo_plug_subscribe (int plug) {
-    static char subscribe[] =
-        "6864001e636cFFFFFFFFFFFF202020202020FFFFFFFFFFFF202020202020";
-    const char *mac = Plugs[plug].macaddress;
-    int i, j, k;
-    for (i = 0, j = 12, k = 46; i < 12; i += 2, j += 2, k -= 2) {
-        subscribe[j] = subscribe[k] = mac[i];
-        subscribe[j+1] = subscribe[k+1] = mac[i+1];
+// Build the binary command frames for this plug. This is done once,
+// when the MAC address becomes known, so that sending a command does
+// not require any encoding.
+//
+static void orvibo_plug_frames (int plug) {
+
+    static const unsigned char probe[] = {
+        0x68, 0x64, 0x00, 0x12, 0x71, 0x67, 0, 0, 0, 0, 0, 0,
+        0x20, 0x20, 0x20, 0x20, 0x20, 0x20};
+    static const unsigned char subscribe[] = {
+        0x68, 0x64, 0x00, 0x1e, 0x63, 0x6c, 0, 0, 0, 0, 0, 0,
+        0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0, 0, 0, 0, 0, 0,
+        0x20, 0x20, 0x20, 0x20, 0x20, 0x20};
+    static const unsigned char control[] = {
+        0x68, 0x64, 0x00, 0x17, 0x64, 0x63, 0, 0, 0, 0, 0, 0,
+        0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0, 0, 0, 0, 0};
+
+    struct PlugMap *p = PLUG(plug);
+    int i;
+
+    memcpy (p->probe, probe, sizeof(p->probe));
+    memcpy (p->subscribe, subscribe, sizeof(p->subscribe));
+    memcpy (p->control[0], control, sizeof(p->control[0]));
+    memcpy (p->control[1], control, sizeof(p->control[1]));
+    for (i = 0; i < 6; ++i) {
+        unsigned char byte = (unsigned char)(p->mac >> (40 - (8 * i)));
+        p->probe[6+i] = p->subscribe[6+i] = p->subscribe[23-i] = byte;
+        p->control[0][6+i] = p->control[1][6+i] = byte;
     }
-    orvibo_plug_send (&(Plugs[plug].ipaddress), subscribe);
+    p->control[1][22] = 1;
 }
 
-static void orvibo_plug_control (int plug, int state) {
-    static char command[] =
-        "686400176463FFFFFFFFFFFF202020202020000000000F";
-    const char *mac = Plugs[plug].macaddress;
-    int i, j;
-    for (i = 0, j = 12; i < 12; i += 2, j += 2) {
-        command[j] = mac[i];
-        command[j+1] = mac[i+1];
+void orvibo_plug_flush (void) {
+    orvibo_pacer_flush ();
+}
+
+static void orvibo_plug_send_tagged (int priority, int interface,
+                                     const struct sockaddr_in *a,
+                                     const unsigned char *d, int length,
+                                     int tag) {
+    if (echttp_isdebug())
+        orvibo_plug_dump ((a==orvibo_interface_broadcast(interface))?
+                             "broadcast":"sending", d, length);
+    orvibo_pacer_send (priority,
+                       orvibo_interface_socket(interface), a, d, length, tag);
+}
+
+static void orvibo_plug_send (int priority, int interface,
+                              const struct sockaddr_in *a,
+                              const unsigned char *d, int length) {
+    orvibo_plug_send_tagged (priority, interface, a, d, length, -1);
+}
+
+static void orvibo_plug_sense (int interface) {
+    static const unsigned char sense[] = {0x68, 0x64, 0x00, 0x06, 0x71, 0x61};
+    orvibo_plug_send (ORVIBO_PACER_PROBE, interface,
+                      orvibo_interface_broadcast(interface), sense, sizeof(sense));
+    orvibo_metrics_add (ORVIBO_TX_BROADCAST, 1);
+    orvibo_interface_add (interface, ORVIBO_IF_BROADCAST, 1);
+}
+
+static void orvibo_plug_subscribe (int plug, int priority) {
+    orvibo_plug_send (priority, PLUG(plug)->interface,
+                      &(PLUG(plug)->ipaddress), PLUG(plug)->subscribe, sizeof(PLUG(plug)->subscribe));
+}
+
+static void orvibo_plug_control (int plug, int state, int priority) {
+    orvibo_plug_send (priority, PLUG(plug)->interface,
+                      &(PLUG(plug)->ipaddress), PLUG(plug)->control[state?1:0],
+                      sizeof(PLUG(plug)->control[0]));
+}
+
+static long long orvibo_plug_ack_timeout (const struct PlugMap *p) {
+    long long timeout = (long long)(p->rttmean + 4 * sqrt (p->rttvariance));
+    if (timeout < ORVIBO_ACK_MIN) timeout = ORVIBO_ACK_MIN;
+    if (timeout > ORVIBO_ACK_MAX) timeout = ORVIBO_ACK_MAX;
+    return timeout << p->retransmits;
+}
+
+// Send the commanded state to the plug, and wait for the acknowledgment.
+//
+// Send the control frame, preceded by a subscription only if there is no
+// confirmed subscription, or if it may have expired.
+//
+static void orvibo_plug_transmit (int plug, long long now, int priority) {
+    struct PlugMap *p = PLUG(plug);
+    if (!p->subscribed || now >= p->subscribed + PlugsSubscription) {
+        p->subscribed = 0;
+        orvibo_plug_subscribe (plug, priority);
+        orvibo_metrics_add (ORVIBO_TX_SUBSCRIBE, 1);
+    }
+    orvibo_plug_control (plug, p->commanded, priority);
+}
+
+static void orvibo_plug_command (int plug, long long now, int priority) {
+    struct PlugMap *p = PLUG(plug);
+    orvibo_plug_transmit (plug, now, priority);
+    p->sequence += 1;
+    p->commandsent = now;
+    orvibo_metrics_add (ORVIBO_CMD_SENT, 1);
+    p->retransmits = 0;
+    orvibo_timer_set (ORVIBO_TIMER_ID(plug, ORVIBO_TIMER_ACK),
+                      now + orvibo_plug_ack_timeout (p));
+}
+
+static void orvibo_plug_acknowledged (int plug, long long now) {
+    struct PlugMap *p = PLUG(plug);
+    int latency = (int)(now - p->commandsent);
+    int bucket = 0;
+    int value;
+    for (value = latency; value > 0; value >>= 1) bucket += 1;
+    if (bucket >= ORVIBO_LATENCY_BUCKETS) bucket = ORVIBO_LATENCY_BUCKETS - 1;
+    p->latency[bucket] += 1;
+    if (latency > p->latencymax) p->latencymax = latency;
+    orvibo_metrics_add (ORVIBO_CMD_ACKED, 1);
+    orvibo_metrics_record (ORVIBO_HIST_ACK_MS, latency);
+    if (echttp_isdebug())
+        fprintf (stderr, "plug %s acknowledged command %d in %d ms (%d retransmits)\n",
+                 p->name, p->sequence, latency, p->retransmits);
+    p->commandsent = 0;
+    orvibo_timer_cancel (ORVIBO_TIMER_ID(plug, ORVIBO_TIMER_ACK));
+}
+
+// A command that was never sent, or sent to a plug that went silent,
+// will not be acknowledged: its latency must not be measured later.
+//
+static void orvibo_plug_abandon (int plug) {
+    PLUG(plug)->commandsent = 0;
+    orvibo_timer_cancel (ORVIBO_TIMER_ID(plug, ORVIBO_TIMER_ACK));
+}
+
+static void orvibo_plug_ack_overdue (int plug, long long now) {
+    struct PlugMap *p = PLUG(plug);
+    if (!p->commandsent) return;
+    if (!p->detected) {
+        orvibo_plug_abandon (plug);
+        return;
+    }
+    if (p->retransmits >= ORVIBO_ACK_RETRANSMIT) return; // Wait for retry.
+
+    // The command might still be waiting in the transmit queue.
+    //
+    if (orvibo_pacer_depth (ORVIBO_PACER_COMMAND) > 0) {
+        orvibo_timer_set (ORVIBO_TIMER_ID(plug, ORVIBO_TIMER_ACK),
+                          now + orvibo_plug_ack_timeout (p));
+        return;
+    }
+    p->retransmits += 1;
+    orvibo_metrics_add (ORVIBO_CMD_RETRANSMIT, 1);
+    if (echttp_isdebug())
+        fprintf (stderr, "plug %s command %d overdue, retransmit %d\n",
+                 p->name, p->sequence, p->retransmits);
+    p->subscribed = 0; // The control frame may have been rejected.
+    orvibo_plug_transmit (plug, now, ORVIBO_PACER_RETRY);
+    orvibo_timer_set (ORVIBO_TIMER_ID(plug, ORVIBO_TIMER_ACK),
+                      now + orvibo_plug_ack_timeout (p));
+}
+
+// The retry delay doubles after each retry, up to a cap, and is randomized
+// (between half and the full delay) so that plugs that failed together do
+// not retry together. After a few retries the plug is declared unreachable:
+// the retries continue at the capped period, but are no longer logged.
+//
+static long long orvibo_plug_backoff (const struct PlugMap *p) {
+    long long delay = ORVIBO_RETRY_CAP;
+    if (p->retries < 16) {
+        delay = (long long)ORVIBO_RETRY_PERIOD << p->retries;
+        if (delay > ORVIBO_RETRY_CAP) delay = ORVIBO_RETRY_CAP;
+    }
+    return (delay / 2) + (random() % ((delay / 2) + 1));
+}
+
+static void orvibo_plug_converged (int plug) {
+    struct PlugMap *p = PLUG(plug);
+    p->retries = 0;
+    if (p->unreachable) {
+        p->unreachable = 0;
+        houselog_event ("DEVICE", p->name, "REACHABLE",
+                        "%s", p->status?"on":"off");
+        orvibo_plug_changed (plug);
+    }
+    orvibo_timer_cancel (ORVIBO_TIMER_ID(plug, ORVIBO_TIMER_RETRY));
+}
+
+// Schedule a retry if the plug has not reached the commanded state.
+//
+static void orvibo_plug_converge (int plug, long long now) {
+    if (!PLUG(plug)->detected) return;
+    if (PLUG(plug)->status == PLUG(plug)->commanded) {
+        orvibo_plug_converged (plug);
+        return;
+    }
+    int id = ORVIBO_TIMER_ID(plug, ORVIBO_TIMER_RETRY);
+    if (!orvibo_timer_pending (id))
+        orvibo_timer_set (id, now + orvibo_plug_backoff (PLUG(plug)));
+}
+
+static void orvibo_plug_retry (int plug, long long now) {
+    struct PlugMap *p = PLUG(plug);
+    if (!p->detected) return;
+    if (p->status == p->commanded) return;
+    const char *state = p->commanded?"on":"off";
+    p->retries += 1;
+    if (p->retries < ORVIBO_RETRY_LIMIT) {
+        orvibo_event ("DEVICE", p->name, "RETRY", "%s", state);
+    } else if (!p->unreachable) {
+        p->unreachable = 1;
+        orvibo_event ("DEVICE", p->name, "UNREACHABLE",
+                      "AFTER %d RETRIES", p->retries);
+        orvibo_plug_changed (plug);
+    }
+    orvibo_metrics_add (ORVIBO_CMD_RETRY, 1);
+    p->subscribed = 0; // The control frame may have been rejected.
+    orvibo_plug_command (plug, now, ORVIBO_PACER_RETRY);
+    orvibo_plug_converge (plug, now);
+}
+
+static void orvibo_plug_pulse_end (int plug, long long now) {
+    houselog_event ("DEVICE", PLUG(plug)->name, "RESET", "END OF PULSE");
+    PLUG(plug)->commanded = 0;
+    PLUG(plug)->deadline = 0;
+    orvibo_plug_changed (plug);
+    if (PLUG(plug)->detected && PLUG(plug)->status) {
+        orvibo_plug_command (plug, now, ORVIBO_PACER_COMMAND);
+        orvibo_plug_converge (plug, now);
+    }
+}
+
+// Accrual suspicion score: how unlikely it is that the reply to the
+// oldest unanswered probe is just late, given the RTT distribution.
+//
+static double orvibo_plug_suspicion (const struct PlugMap *p, long long now) {
+    if (!p->probesent) return 0.0;
+    // A plug only seen through discovery replies has no RTT sample yet.
+    double mean = (p->rttmean > 0) ? p->rttmean : ORVIBO_RTT_DEFAULT;
+    double deviation = sqrt (p->rttvariance);
+    if (deviation < ORVIBO_JITTER_MIN) deviation = ORVIBO_JITTER_MIN;
+    double elapsed = (double)(now - p->probesent);
+    double later = 0.5 * erfc ((elapsed - mean) / (deviation * M_SQRT2));
+    if (later < 1e-12) return 12.0;
+    return -log10 (later);
+}
+
+// Only a reply to a probe gives an RTT sample, measured from the most
+// recent probe: a lost probe must not inflate the RTT.
+//
+static void orvibo_plug_reply (struct PlugMap *p, long long now, int isprobe) {
+    if (isprobe && p->probelast) {
+        double rtt = (double)(now - p->probelast);
+        if (p->rttmean <= 0) {
+            p->rttmean = rtt;
+            p->rttvariance = (rtt * rtt) / 4;
+        } else {
+            double delta = rtt - p->rttmean;
+            p->rttmean += delta / 8;
+            p->rttvariance += ((delta * delta) - p->rttvariance) / 8;
+        }
+    }
+    p->probesent = 0;
+    p->probelast = 0;
+    p->missed = 0;
+    p->lastseen = now;
+}
+
+// The probes of the whole fleet must fit in their share of the transmit
+// rate, so the shortest interval grows with the number of plugs.
+//
+static double orvibo_plug_probe_floor (void) {
+    double shortest = ORVIBO_PROBE_MIN;
+    int rate = orvibo_pacer_rate ();
+    if (rate > 0) {
+        double fleet = (PlugsCount * 1000.0 * ORVIBO_PROBE_SHARE) / rate;
+        if (fleet > shortest) shortest = fleet;
     }
-    command[strlen(command)-1] = state?'1':'0';
-    orvibo_plug_send (&(Plugs[plug].ipaddress), command);
+    return shortest;
+}
+
+// A plug with a stable RTT is probed less often. The interval is
+// randomized by +/- 20% to spread the probes.
+//
+static long long orvibo_plug_probe_interval (const struct PlugMap *p) {
+    double shortest = orvibo_plug_probe_floor ();
+    double interval = ORVIBO_PROBE_MAX;
+    if (p->detected && p->missed > 0) {
+        // Confirm quickly whether the plug is gone or the probe was lost.
+        interval = p->rttmean + 4 * sqrt (p->rttvariance);
+    } else if (p->detected) {
+        interval /= 1.0 + (sqrt (p->rttvariance) / ORVIBO_JITTER_REF);
+    }
+    if (interval > ORVIBO_PROBE_MAX) interval = ORVIBO_PROBE_MAX;
+    if (interval < shortest) interval = shortest;
+    return (long long)(interval * (0.8 + (0.4 * random() / RAND_MAX)));
+}
+
+// The probe clocks start when the probe leaves the pacer, not when it
+// is queued, so that a long transmit queue is not mistaken for a silence.
+//
+static void orvibo_plug_probed (int plug, long long now) {
+    if (plug >= PlugsCount) return;
+    struct PlugMap *p = PLUG(plug);
+    if (!p->probequeued) return; // The plug was removed or reset.
+    p->probequeued = 0;
+    if (!p->probesent) p->probesent = now;
+    p->probelast = now;
+}
+
+static void orvibo_plug_probe (int plug, long long now) {
+
+    struct PlugMap *p = PLUG(plug);
+
+    if (!p->ipaddress.sin_addr.s_addr) return; // Never seen.
+
+    int probeid = ORVIBO_TIMER_ID(plug, ORVIBO_TIMER_PROBE);
+    if (p->probequeued) {
+        // The previous probe did not leave yet: do not add to the queue.
+        orvibo_timer_set (probeid, now + orvibo_plug_probe_interval (p));
+        return;
+    }
+
+    if (p->probesent) {
+        p->missed += 1;
+        long long silent = (long long)(3 * orvibo_plug_probe_floor ());
+        if (silent < ORVIBO_SILENT_MAX) silent = ORVIBO_SILENT_MAX;
+        if (p->detected &&
+            ((p->missed >= ORVIBO_PROBE_MISSES &&
+              orvibo_plug_suspicion (p, now) >= ORVIBO_PHI_THRESHOLD) ||
+             now - p->lastseen > silent)) {
+            orvibo_event ("DEVICE", p->name, "SILENT",
+                          "MAC ADDRESS %s", p->macaddress);
+            p->detected = 0;
+            p->subscribed = 0;
+            orvibo_plug_abandon (plug);
+            orvibo_plug_changed (plug);
+            orvibo_metrics_add (ORVIBO_PLUG_SILENT, 1);
+        }
+    }
+    p->probequeued = 1;
+    orvibo_plug_send_tagged (ORVIBO_PACER_PROBE, p->interface,
+                             &(p->ipaddress), p->probe, sizeof(p->probe), plug);
+    orvibo_metrics_add (ORVIBO_TX_PROBE, 1);
+    orvibo_timer_set (probeid, now + orvibo_plug_probe_interval (p));
+}
+
+static void orvibo_plug_timer (int fd, int mode) {
+
+    long long now = orvibo_timer_now ();
+    int id;
+
+    while ((id = orvibo_timer_expired (now)) >= 0) {
+        int plug = id / ORVIBO_TIMER_KINDS;
+        if (plug >= PlugsCount) continue;
+        switch (id % ORVIBO_TIMER_KINDS) {
+            case ORVIBO_TIMER_PULSE:
+                orvibo_plug_pulse_end (plug, now);
+                break;
+            case ORVIBO_TIMER_RETRY:
+                orvibo_plug_retry (plug, now);
+                break;
+            case ORVIBO_TIMER_PROBE:
+                orvibo_plug_probe (plug, now);
+                break;
+            case ORVIBO_TIMER_ACK:
+                orvibo_plug_ack_overdue (plug, now);
+                break;
+        }
+    }
+    orvibo_plug_flush ();
 }
 
 int orvibo_plug_set (int point, int state, int pulse) {
 
     const char *namedstate = state?"on":"off";
+    long long now = orvibo_timer_now ();
 
-    if (point < 0 || point > PlugsCount) return 0;
+    if (point < 0 || point >= PlugsCount) return 0;
+    if (!PLUG(point)->name[0]) return 0; // Free slot.
 
     if (echttp_isdebug()) {
-        if (pulse) fprintf (stderr, "set %s to %s at %lld (pulse %ds)\n", Plugs[point].name, namedstate, (long long)time(0), pulse);
-        else       fprintf (stderr, "set %s to %s at %lld\n", Plugs[point].name, namedstate, (long long)time(0));
+        if (pulse) fprintf (stderr, "set %s to %s at %lld (pulse %ds)\n", PLUG(point)->name, namedstate, (long long)time(0), pulse);
+        else       fprintf (stderr, "set %s to %s at %lld\n", PLUG(point)->name, namedstate, (long long)time(0));
     }
 
+    int pulseid = ORVIBO_TIMER_ID(point, ORVIBO_TIMER_PULSE);
     if (pulse > 0) {
-        Plugs[point].deadline = time(0) + pulse;
-        houselog_event ("DEVICE", Plugs[point].name, "SET",
+        PLUG(point)->deadline = time(0) + pulse;
+        orvibo_timer_set (pulseid, now + (1000LL * pulse));
+        houselog_event ("DEVICE", PLUG(point)->name, "SET",
                         "%s FOR %d SECONDS", namedstate, pulse);
     } else {
-        Plugs[point].deadline = 0;
-        houselog_event ("DEVICE", Plugs[point].name, "SET", "%s", namedstate);
+        PLUG(point)->deadline = 0;
+        orvibo_timer_cancel (pulseid);
+        houselog_event ("DEVICE", PLUG(point)->name, "SET", "%s", namedstate);
     }
-    Plugs[point].commanded = state;
+    PLUG(point)->commanded = state;
+    PLUG(point)->retries = 0; // A new command deserves a fresh start.
+    orvibo_timer_cancel (ORVIBO_TIMER_ID(point, ORVIBO_TIMER_RETRY));
 
     // Only send a command if we detected the device on the network.
     //
-    if (Plugs[point].detected) {
-        orvibo_plug_subscribe (point);
-        orvibo_plug_control (point, state);
+    if (PLUG(point)->detected) {
+        orvibo_plug_command (point, now, ORVIBO_PACER_COMMAND);
+        orvibo_plug_converge (point, now);
+    } else {
+        orvibo_plug_abandon (point);
     }
-    housestate_changed (LiveState);
+    orvibo_plug_changed (point);
     return 1;
 }
 
+// The broadcast discovery is frequent only while some configured plugs
+// have not been found yet. The detected plugs are tracked by the health
+// probes instead. Each interface has its own schedule: a missing plug
+// which interface is known only speeds up the discovery on that interface,
+// while a plug never seen speeds it up everywhere.
+//
 void orvibo_plug_periodic (time_t now) {
 
-    static time_t LastRetry = 0;
-    static time_t LastSense = 0;
+    static time_t LastSense[ORVIBO_INTERFACE_MAX];
+    static int Period[ORVIBO_INTERFACE_MAX];
+
+    int interfaces = orvibo_interface_count ();
+    int due = 0;
     int i;
 
-    if (now >= LastSense + 30) {
-        LastSense = now;
-        orvibo_plug_sense ();
+    for (i = 0; i < interfaces; ++i) {
+        if (now >= LastSense[i] + Period[i]) due = 1;
     }
-
-    if (now < LastRetry + 5) return;
-    LastRetry = now;
-
-    for (i = 0; i < PlugsCount; ++i) {
-        // If we did not detect a plug for 3 senses, consider it failed.
-        if (Plugs[i].detected > 0 && Plugs[i].detected < now - 90) {
-            houselog_event ("DEVICE", Plugs[i].name, "SILENT",
-                            "MAC ADDRESS %s", Plugs[i].macaddress);
-            Plugs[i].detected = 0;
-            housestate_changed (LiveState);
+    if (due) {
+        int missing[ORVIBO_INTERFACE_MAX];
+        int unlocated = 0;
+
+        memset (missing, 0, sizeof(missing));
+        for (i = 0; i < PlugsCount; ++i) {
+            struct PlugMap *p = PLUG(i);
+            if (!p->mac || p->detected) continue;
+            if (p->ipaddress.sin_addr.s_addr)
+                missing[p->interface] = 1;
+            else
+                unlocated = 1;
         }
-
-        if (Plugs[i].deadline > 0 && now >= Plugs[i].deadline) {
-            houselog_event ("DEVICE", Plugs[i].name, "RESET", "END OF PULSE");
-            Plugs[i].commanded = 0;
-            Plugs[i].deadline = 0;
-            housestate_changed (LiveState);
-        }
-        if (Plugs[i].status != Plugs[i].commanded) {
-            if (Plugs[i].detected) {
-                const char *state = Plugs[i].commanded?"on":"off";
-                houselog_event ("DEVICE", Plugs[i].name, "RETRY", state);
-                orvibo_plug_subscribe (i);
-                orvibo_plug_control (i, Plugs[i].commanded);
-            }
+        for (i = 0; i < interfaces; ++i) {
+            if (now < LastSense[i] + Period[i]) continue;
+            LastSense[i] = now;
+            orvibo_plug_sense (i);
+            if (PlugsCount <= 0 || unlocated || missing[i])
+                Period[i] = ORVIBO_SENSE_FAST;
+            else
+                Period[i] = ORVIBO_SENSE_SLOW;
         }
     }
+    orvibo_plug_flush ();
+}
+
+static void orvibo_plug_remove (int plug, int version) {
+    int kind;
+    if (PLUG(plug)->name[0])
+        orvibo_plug_tombstone (PLUG(plug)->name, version);
+    for (kind = 0; kind < ORVIBO_TIMER_KINDS; ++kind)
+        orvibo_timer_cancel (ORVIBO_TIMER_ID(plug, kind));
+    orvibo_plug_unindex (plug);
+    orvibo_snapshot_clear (plug);
+    memset (PLUG(plug), 0, sizeof(struct PlugMap));
+    orvibo_plug_release (plug);
 }
 
+// Apply the configuration to the existing set of plugs. The plugs are
+// matched by MAC address: the runtime state of the plugs that remain
+// in the configuration (detection, IP address, commanded state, pulse)
+// is preserved, only the plugs added or removed are affected.
+//
 const char *orvibo_plug_refresh (void) {
 
+    struct timespec start, end;
+    int added = 0, removed = 0, updated = 0;
     int i;
-    for (i = 0; i < PlugsCount; ++i) {
-        Plugs[i].name[0] = 0;
-        Plugs[i].macaddress[0] = 0;
-        Plugs[i].description[0] = 0;
-        Plugs[i].deadline = 0;
-        Plugs[i].detected = 0;
-    }
-    PlugsCount = 0;
 
-    if (!houseconfig_active()) return 0;
+    clock_gettime (CLOCK_MONOTONIC, &start);
 
-    int plugs = houseconfig_array (0, ".orvibo.plugs");
-    if (plugs < 0) return "cannot find plugs array";
-
-    PlugsCount = houseconfig_array_length (plugs);
-    if (echttp_isdebug()) fprintf (stderr, "found %d plugs\n", PlugsCount);
+    int plugs = -1;
+    int count = 0;
+    if (houseconfig_active()) {
+        plugs = houseconfig_array (0, ".orvibo.plugs");
+        if (plugs < 0) return "cannot find plugs array";
+        count = houseconfig_array_length (plugs);
+        if (echttp_isdebug()) fprintf (stderr, "found %d plugs\n", count);
+    }
 
-    PlugsSpace = PlugsCount + 32;
+    housestate_changed (LiveState);
+    int version = housestate_current (LiveState);
+
+    for (i = 0; i < PlugsCount; ++i) PLUG(i)->configured = 0;
+
+    int *list = calloc (count + 1, sizeof(int));
+    if (!list) return "no more memory";
+    if (count > 0) houseconfig_enumerate (plugs, list, count);
+
+    for (i = 0; i < count; ++i) {
+        int item = houseconfig_object (list[i], 0);
+        if (item <= 0) continue;
+        const char *name = houseconfig_string (item, ".name");
+        const char *mac = houseconfig_string (item, ".address");
+        const char *desc = houseconfig_string (item, ".description");
+        if (!name) name = "";
+        if (!mac) mac = "";
+        if (!desc) desc = "";
+
+        uint64_t macbin = orvibo_plug_mac_parse (mac);
+        int plug = macbin ? orvibo_plug_mac_search (macbin)
+                          : orvibo_plug_search (name);
+        if (plug >= 0 && PLUG(plug)->configured) {
+            houselog_trace (HOUSE_WARNING, "CONFIG",
+                            "duplicate plug %s (%s)", name, mac);
+            continue;
+        }
 
-    Plugs = calloc(sizeof(struct PlugMap), PlugsSpace);
-    if (!Plugs) return "no more memory";
+        if (plug < 0) {
+            plug = orvibo_plug_allocate ();
+            if (plug < 0) {
+                free (list);
+                return "no more memory";
+            }
+            snprintf (PLUG(plug)->name, sizeof(PLUG(plug)->name), "%s", name);
+            snprintf (PLUG(plug)->macaddress,
+                      sizeof(PLUG(plug)->macaddress), "%s", mac);
+            snprintf (PLUG(plug)->description,
+                      sizeof(PLUG(plug)->description), "%s", desc);
+            PLUG(plug)->mac = macbin;
+            if (macbin) orvibo_plug_frames (plug);
+            orvibo_plug_index (plug);
+            PLUG(plug)->version = version;
+            added += 1;
+            if (echttp_isdebug()) fprintf (stderr, "added plug %s, address %s\n", name, mac);
 
-    int *list = calloc (PlugsCount, sizeof(int));
-    houseconfig_enumerate (plugs, list, PlugsCount);
-    for (i = 0; i < PlugsCount; ++i) {
-        int plug = houseconfig_object (list[i], 0);
-        if (plug <= 0) continue;
-        const char *name = houseconfig_string (plug, ".name");
-        if (name) {
-            strncpy (Plugs[i].name, name, sizeof(Plugs[i].name));
-            Plugs[i].name[sizeof(Plugs[i].name)-1] = 0;
+        } else {
+            int changed = 0;
+            if (strncmp (PLUG(plug)->name, name, sizeof(PLUG(plug)->name)-1)) {
+                orvibo_plug_tombstone (PLUG(plug)->name, version);
+                orvibo_plug_unindex (plug);
+                snprintf (PLUG(plug)->name, sizeof(PLUG(plug)->name), "%s", name);
+                orvibo_plug_index (plug);
+                changed = 1;
+            }
+            if (strncmp (PLUG(plug)->description, desc,
+                         sizeof(PLUG(plug)->description)-1)) {
+                snprintf (PLUG(plug)->description,
+                          sizeof(PLUG(plug)->description), "%s", desc);
+                changed = 1;
+            }
+            if (changed) {
+                PLUG(plug)->version = version;
+                updated += 1;
+            }
         }
-        const char *mac = houseconfig_string (plug, ".address");
-        if (mac)
-            strncpy (Plugs[i].macaddress, mac, sizeof(Plugs[i].macaddress));
-        const char *desc = houseconfig_string (plug, ".description");
-        if (desc)
-            snprintf (Plugs[i].description, sizeof(Plugs[i].description), "%s", desc);
-        if (echttp_isdebug()) fprintf (stderr, "found plug %s, address %s\n", Plugs[i].name, Plugs[i].macaddress);
-        Plugs[i].commanded = 0;
-        Plugs[i].deadline = 0;
+        PLUG(plug)->configured = 1;
+        PLUG(plug)->discovered = 0;
     }
     free (list);
-    housestate_changed (LiveState);
 
+    for (i = 0; i < PlugsCount; ++i) {
+        if (PLUG(i)->configured || PLUG(i)->discovered) continue;
+        if (!PLUG(i)->name[0] && !PLUG(i)->mac) continue; // Free slot.
+        if (echttp_isdebug()) fprintf (stderr, "removed plug %s\n", PLUG(i)->name);
+        orvibo_plug_remove (i, version);
+        removed += 1;
+    }
+
+    const char *error = orvibo_scene_refresh ();
+    if (error)
+        houselog_trace (HOUSE_FAILURE, "CONFIG",
+                        "cannot load groups and scenes: %s", error);
+
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    long elapsed = ((end.tv_sec - start.tv_sec) * 1000000)
+                       + ((end.tv_nsec - start.tv_nsec) / 1000);
+    houselog_trace (HOUSE_INFO, "CONFIG",
+                    "reloaded in %ld.%03ld ms: %d plugs added, %d removed, %d updated",
+                    elapsed / 1000, elapsed % 1000, added, removed, updated);
+    orvibo_metrics_add (ORVIBO_CONFIG_RELOAD, 1);
     return 0;
 }
 
 const char *orvibo_plug_live_config (char *buffer, int size) {
 
-    static char pool[65537];
-    static ParserToken token[1024];
-    ParserContext context = echttp_json_start (token, 1024, pool, sizeof(pool));
+    static char *pool = 0;
+    static ParserToken *token = 0;
+    static int tokencount = 0;
 
     int i;
+    int needed = 16 + (4 * PlugsCount) + orvibo_scene_tokens ();
+
+    if (tokencount < needed) {
+        tokencount = needed;
+        free (pool);
+        free (token);
+        pool = malloc (tokencount * 96);
+        token = malloc (tokencount * sizeof(ParserToken));
+        if (!pool || !token) {
+            tokencount = 0;
+            return "no more memory";
+        }
+    }
+    ParserContext context =
+        echttp_json_start (token, tokencount, pool, tokencount * 96);
 
     int root = echttp_json_add_object (context, 0, 0);
     int top = echttp_json_add_object (context, root, "orvibo");
     int plugs = echttp_json_add_array (context, top, "plugs");
 
     for (i = 0; i < PlugsCount; ++i) {
-        if (Plugs[i].name[0] == 0 || Plugs[i].macaddress[0] == 0) continue;
+        if (PLUG(i)->name[0] == 0) continue; // Free slot.
         int plug = echttp_json_add_object (context, plugs, 0);
-        echttp_json_add_string (context, plug, "name", Plugs[i].name);
-        echttp_json_add_string (context, plug, "address", Plugs[i].macaddress);
+        echttp_json_add_string (context, plug, "name", PLUG(i)->name);
+        echttp_json_add_string (context, plug, "address", PLUG(i)->macaddress);
         echttp_json_add_string
-            (context, plug, "description", Plugs[i].description);
+            (context, plug, "description", PLUG(i)->description);
     }
+    orvibo_scene_live_config (context, top);
     return echttp_json_export (context, buffer, size);
 }
 
-static int binary_equal (const unsigned char *a, const unsigned char *b, int size) {
-    while (--size >= 0) {
-        if (a[size] != b[size]) return 0;
-    }
-    return 1;
-}
-
 static void importmac (char *mac, const unsigned char *data, int start) {
     int i, j;
     for (i = start + 5, j = 10; i >= start; --i, j -= 2) {
@@ -397,96 +1267,251 @@ static void importmac (char *mac, const unsigned char *data, int start) {
     mac[12] = 0;
 }
 
-static int orvibo_plug_mac_search (const char *mac) {
+// Add a plug that is not in the configuration, using a generated name.
+//
+static int orvibo_plug_create (uint64_t macbin) {
+
+    static int PlugsFull = 0;
+    unsigned char data[6];
+    char mac[16];
     int i;
-    for (i = 0; i < PlugsCount; ++i) {
-        if (!strcmp(mac, Plugs[i].macaddress)) return i;
+
+    int plug = orvibo_plug_allocate ();
+    if (plug < 0 || !PlugsHashSize) {
+        if (!PlugsFull)
+            houselog_trace (HOUSE_FAILURE, "PLUG",
+                            "cannot add plug %d", PlugsCount);
+        PlugsFull = 1;
+        return -1;
     }
-    return -1;
+    PlugsFull = 0;
+    for (i = 0; i < 6; ++i) data[i] = (unsigned char)(macbin >> (40 - (8 * i)));
+    importmac (mac, data, 0);
+    if (echttp_isdebug()) fprintf (stderr, "new device %s\n", mac);
+    int suffix = plug;
+    do {
+        snprintf (PLUG(plug)->name,
+                  sizeof(PLUG(0)->name), "plug%d", suffix++);
+    } while (orvibo_plug_search (PLUG(plug)->name) >= 0);
+    snprintf (PLUG(plug)->macaddress, sizeof(PLUG(0)->macaddress), "%s", mac);
+    snprintf (PLUG(plug)->description, sizeof(PLUG(0)->description),
+              "autogenerated");
+    PLUG(plug)->mac = macbin;
+    PLUG(plug)->discovered = 1;
+    orvibo_plug_frames (plug);
+    orvibo_plug_index (plug);
+    houselog_event ("DEVICE", PLUG(plug)->name, "ADDED", "MAC ADDRESS %s", mac);
+    return plug;
 }
 
-static void orvibo_plug_dump (unsigned char *d, int l) {
-    char buffer[256];
-    int i, j;
+// The frames sent by the plugs. Each frame starts with a 6 bytes header:
+// the magic "hd", the total length (16 bits, big endian) and a 2 letters
+// code. The length must match both the datagram size and the frame type.
+// The frames sent by the clients (including our own broadcasts, which
+// come back to us) have different lengths and are ignored, except the
+// control command: a dc frame is the same length both ways, so it cannot
+// tell which state the plug is in, and is never used as a state report.
+//
+#define ORVIBO_FRAME_DISCOVERY  1 // Reply to a broadcast discovery (qa).
+#define ORVIBO_FRAME_SUBSCRIBED 2 // Reply to a subscription (cl).
+#define ORVIBO_FRAME_CONTROLLED 3 // Reply to a control command (dc).
+#define ORVIBO_FRAME_STATE      4 // State report, solicited or not (sf).
+#define ORVIBO_FRAME_HEARTBEAT  5 // Reply to a heartbeat (hb).
+#define ORVIBO_FRAME_PROBED     6 // Reply to a single plug discovery (qg).
+
+#define ORVIBO_FRAME_NOSTATE 0xff
+
+struct PlugFrameType {
+    char code[2];
+    unsigned char length;   // Exact length, or minimum if "atleast".
+    unsigned char atleast;
+    unsigned char kind;
+    unsigned char macpos;
+    unsigned char statepos; // 0 if the frame has no state.
+    int counter;
+};
 
-    if (l >= sizeof(buffer) / 2) l = (sizeof(buffer) / 2) - 1;
-    buffer[l*2] = 0;
-    for (i = l-1, j = (l-1)*2; i >= 0; --i, j -= 2) {
-        buffer[j] = bin2hex(d[i]>>4);
-        buffer[j+1] = bin2hex(d[i]);
-    }
-    fprintf (stderr, "received: %s\n", buffer);
-}
+static const struct PlugFrameType PlugFrameTypes[] = {
+    {"qa", 0x2a, 0, ORVIBO_FRAME_DISCOVERY,  7, 41, ORVIBO_RX_DISCOVERY},
+    {"qg", 0x2a, 0, ORVIBO_FRAME_PROBED,     7, 41, ORVIBO_RX_DISCOVERY},
+    {"cl", 0x18, 0, ORVIBO_FRAME_SUBSCRIBED, 6, 23, ORVIBO_RX_SUBSCRIBED},
+    {"dc", 0x17, 0, ORVIBO_FRAME_CONTROLLED, 6,  0, ORVIBO_RX_CONTROLLED},
+    {"sf", 0x17, 0, ORVIBO_FRAME_STATE,      6, 22, ORVIBO_RX_REPLY},
+    {"hb", 0x0c, 1, ORVIBO_FRAME_HEARTBEAT,  6,  0, ORVIBO_RX_HEARTBEAT},
+    {"",   0,    0, 0,                       0,  0, 0}
+};
 
-static void orvibo_plug_receive (int fd, int mode) {
+// Decode one datagram, in place. This may run in the receive thread: this
+// must not access the plugs (see orvibo_ingest.c).
+//
+static int orvibo_plug_decode (const unsigned char *data, int size,
+                               struct OrviboUpdate *update) {
 
-    static unsigned char discovery[] = {0x68, 0x64, 0, 0x2a, 0x71, 0x61, 0};
-    static unsigned char command[] = {0x68, 0x64, 0, 0x17, 0x73};
+    const struct PlugFrameType *t;
 
-    unsigned char data[128];
-    struct sockaddr_in addr;
-    socklen_t addrlen = sizeof(addr);
+    if (size <= 0) return 0;
+    if (echttp_isdebug()) orvibo_plug_dump ("received", data, size);
 
-    int size = recvfrom (OrviboSocket, data, sizeof(data), 0,
-                         (struct sockaddr *)(&addr), &addrlen);
-    if (size > 0) {
-        if (echttp_isdebug()) orvibo_plug_dump (data, size);
+    if (size < 6 || data[0] != 0x68 || data[1] != 0x64 ||
+        ((data[2] << 8) | data[3]) != size) {
+        orvibo_metrics_add (ORVIBO_RX_MALFORMED, 1);
+        return 0;
+    }
+    for (t = PlugFrameTypes; t->kind; ++t) {
+        if (data[4] != t->code[0] || data[5] != t->code[1]) continue;
+        if (t->atleast ? (size < t->length) : (size != t->length)) continue;
+
+        orvibo_metrics_add (t->counter, 1);
+        update->kind = t->kind;
+        update->mac = orvibo_plug_mac_pack (data + t->macpos);
+        update->state =
+            t->statepos ? (data[t->statepos] == 1) : ORVIBO_FRAME_NOSTATE;
+        return 1;
+    }
+    orvibo_metrics_add (ORVIBO_RX_IGNORED, 1);
+    return 0; // Don't do anything with unused data.
+}
 
-        char mac[16];
-        int macstart = 0;
-        int statepos = 0;
-        int plug;
-        if (binary_equal(discovery, data, sizeof(discovery))) {
-            macstart = 7;
-            statepos = 41;
-        } else if (binary_equal(command, data, sizeof(command))) {
-            macstart = 6;
-            statepos = 22;
-        } else {
-            return; // Don't do anything with unused data.
-        }
-        importmac (mac, data, macstart);
-        plug = orvibo_plug_mac_search (mac);
-        if (plug < 0 && PlugsCount < PlugsSpace) {
-            if (echttp_isdebug()) fprintf (stderr, "new device %s\n", mac);
-            plug = PlugsCount++;
-            snprintf (Plugs[plug].name, sizeof(Plugs[0].name), "plug%d", plug);
-            snprintf (Plugs[plug].macaddress, sizeof(Plugs[0].macaddress),
-                      "%s", mac);
-            snprintf (Plugs[plug].description, sizeof(Plugs[0].description),
-                      "autogenerated");
-            houselog_event ("DEVICE", Plugs[plug].name, "ADDED",
-                            "MAC ADDRESS %s", mac);
-            Plugs[plug].detected = time(0); // Skip the "DETECTED" event.
-            housestate_changed (LiveState);
+// Apply one decoded datagram to the plug it came from.
+//
+static void orvibo_plug_apply (const struct OrviboUpdate *update) {
+
+    long long now = update->timestamp;
+    int interface = update->interface;
+
+    int plug = orvibo_plug_mac_search (update->mac);
+    if (plug < 0) {
+        plug = orvibo_plug_create (update->mac);
+        if (plug < 0) return;
+        PLUG(plug)->detected = time(0); // Skip the "DETECTED" event.
+        PLUG(plug)->interface = interface;
+        orvibo_plug_changed (plug);
+        orvibo_metrics_add (ORVIBO_RX_NEWPLUG, 1);
+        orvibo_interface_add (interface, ORVIBO_IF_DETECTED, 1);
+    }
+    struct PlugMap *p = PLUG(plug);
+
+    if (!p->detected) {
+        orvibo_event ("DEVICE", p->name, "DETECTED",
+                      "MAC ADDRESS %s", p->macaddress);
+        orvibo_plug_changed (plug);
+        orvibo_metrics_add (ORVIBO_PLUG_DETECTED, 1);
+        orvibo_interface_add (interface, ORVIBO_IF_DETECTED, 1);
+    }
+    p->interface = interface;
+    p->detected = time(0);
+    orvibo_plug_reply (p, now, update->kind == ORVIBO_FRAME_PROBED);
+    if (update->kind == ORVIBO_FRAME_SUBSCRIBED) p->subscribed = now;
+    int probeid = ORVIBO_TIMER_ID(plug, ORVIBO_TIMER_PROBE);
+    if (!orvibo_timer_pending (probeid))
+        orvibo_timer_set (probeid, now + orvibo_plug_probe_interval (p));
+
+    // Any frame that reports the state confirms an outstanding command,
+    // without waiting for a separate state report.
+    //
+    if (update->state != ORVIBO_FRAME_NOSTATE) {
+        int status = update->state;
+        if (p->status != status) {
+            orvibo_event ("DEVICE", p->name, "CHANGED",
+                          "FROM %s TO %s",
+                          p->status?"on":"off", status?"on":"off");
+            p->status = status;
+            orvibo_plug_changed (plug);
         }
-        if (plug >= 0) {
-            if (!Plugs[plug].detected) {
-                houselog_event ("DEVICE", Plugs[plug].name, "DETECTED",
-                                "MAC ADDRESS %s", mac);
-                housestate_changed (LiveState);
+        if (p->commandsent && status == p->commanded)
+            orvibo_plug_acknowledged (plug, now);
+
+        // The commanded state was restored from the snapshot: enforce it
+        // right away, rather than waiting for the retry timer.
+        //
+        if (p->resumed) {
+            p->resumed = 0;
+            if (status != p->commanded) {
+                orvibo_plug_command (plug, now, ORVIBO_PACER_COMMAND);
+                orvibo_plug_flush ();
             }
-            Plugs[plug].detected = time(0);
-
-            int status = (data[statepos] == 1);
-            if (Plugs[plug].status != status) {
-                houselog_event ("DEVICE", Plugs[plug].name, "CHANGED",
-                                "FROM %s TO %s",
-                                Plugs[plug].status?"on":"off",
-                                status?"on":"off");
-                Plugs[plug].status = status;
-                housestate_changed (LiveState);
-            }
-
-            memcpy (&(Plugs[plug].ipaddress),
-                    &addr, sizeof(Plugs[plug].ipaddress));
         }
     }
+
+    if (memcmp (&(p->ipaddress), &(update->address), sizeof(p->ipaddress))) {
+        p->ipaddress = update->address;
+        p->subscribed = 0; // The plug might have restarted.
+        orvibo_plug_save (plug);
+    }
+    orvibo_plug_converge (plug, now);
+}
+
+// Restore the state of a plug as saved by the previous run. The plug is
+// not considered detected: it is probed right away, and commanded again
+// as soon as it reports a state that differs.
+//
+static void orvibo_plug_resume (const struct OrviboSnapshot *record,
+                                long long now) {
+
+    int plug = orvibo_plug_mac_search (record->mac);
+    if (plug < 0) {
+        plug = orvibo_plug_create (record->mac);
+        if (plug < 0) return;
+    }
+    struct PlugMap *p = PLUG(plug);
+
+    if (record->address) {
+        p->ipaddress.sin_family = AF_INET;
+        p->ipaddress.sin_addr.s_addr = record->address;
+        p->ipaddress.sin_port = record->port;
+        p->interface = orvibo_interface_route (&(p->ipaddress));
+    }
+    p->status = record->status;
+    p->commanded = record->commanded;
+    p->resumed = 1;
+
+    time_t current = time(0);
+    if (record->deadline > current) {
+        p->deadline = (time_t)record->deadline;
+        orvibo_timer_set (ORVIBO_TIMER_ID(plug, ORVIBO_TIMER_PULSE),
+                          now + (1000LL * (p->deadline - current)));
+    } else if (record->deadline) {
+        p->commanded = 0; // The pulse ended while the service was stopped.
+        p->deadline = 0;
+    }
+    if (p->ipaddress.sin_addr.s_addr)
+        orvibo_timer_set (ORVIBO_TIMER_ID(plug, ORVIBO_TIMER_PROBE),
+                          now + (random() % 1000)); // Spread the probes.
+    orvibo_plug_changed (plug);
+}
+
+static void orvibo_plug_restore (int argc, const char **argv) {
+
+    struct OrviboSnapshot record;
+    long long now = orvibo_timer_now ();
+    int count = orvibo_snapshot_initialize (argc, argv);
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        if (orvibo_snapshot_restore (i, &record))
+            orvibo_plug_resume (&record, now);
+    }
+    orvibo_snapshot_reset ();
+    for (i = 0; i < PlugsCount; ++i) orvibo_plug_save (i);
+    if (count > 0) orvibo_plug_flush ();
 }
 
 void orvibo_plug_initialize (int argc, const char **argv, int livestate) {
+
+    const char *option;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-orvibo-subscription=", argv[i], &option))
+            PlugsSubscription = atoi(option) * 1000LL;
+    }
     LiveState = livestate;
-    orvibo_plug_socket ();
-    echttp_listen (OrviboSocket, 1, orvibo_plug_receive, 0);
+    srandom (time(0) ^ getpid());
+    orvibo_interface_initialize (argc, argv);
+    orvibo_pacer_initialize (argc, argv);
+    orvibo_pacer_on_sent (orvibo_plug_probed);
+    orvibo_ingest_initialize (argc, argv, orvibo_plug_decode, orvibo_plug_apply);
+    echttp_listen (orvibo_timer_initialize(), 1, orvibo_plug_timer, 0);
+    orvibo_plug_restore (argc, argv);
 }
 
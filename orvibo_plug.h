@@ -25,7 +25,10 @@ void orvibo_plug_initialize (int argc, const char **argv, int livestate);
 const char *orvibo_plug_refresh (void);
 
 int orvibo_plug_count (void);
+int orvibo_plug_capacity (void);
 const char *orvibo_plug_name (int point);
+int orvibo_plug_search (const char *name);
+int orvibo_plug_search_next (const char *name, int after);
 
 const char *orvibo_plug_live_config (char *buffer, int size);
 
@@ -33,8 +36,14 @@ const char *orvibo_plug_failure (int point);
 
 int    orvibo_plug_commanded (int point);
 time_t orvibo_plug_deadline  (int point);
+int    orvibo_plug_version   (int point);
 int    orvibo_plug_get       (int point);
+int    orvibo_plug_latency   (int point, int *p50, int *p99, int *max);
 int    orvibo_plug_set       (int point, int state, int pulse);
+void   orvibo_plug_flush     (void);
+
+int orvibo_plug_horizon (void);
+const char *orvibo_plug_removed (int since, int *cursor);
 
 void orvibo_plug_periodic (time_t now);
 
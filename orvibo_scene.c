@@ -0,0 +1,439 @@
+/* orvibo - A simple home web server for control of orvibo WiFi plugs
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * orvibo_scene.c - Groups of plugs and scenes.
+ *
+ * A group is a named list of plugs, and can be used as a point name.
+ * A scene is a named list of actions, each action setting a plug or
+ * a group to a state, with an optional pulse. For example:
+ *
+ *    "groups" : [
+ *        {"name" : "kitchen", "plugs" : ["counter", "island"]}
+ *    ],
+ *    "scenes" : [
+ *        {"name" : "evening", "actions" : [
+ *            {"point" : "kitchen", "state" : "on"},
+ *            {"point" : "porch", "state" : "on", "pulse" : 3600}
+ *        ]}
+ *    ]
+ *
+ * The groups and scenes are compiled when the configuration is loaded:
+ * the plug names are resolved, and the groups expanded, so that running
+ * a scene only queues the plugs' pre-encoded frames, in one burst.
+ *
+ * SYNOPSYS:
+ *
+ * const char *orvibo_scene_refresh (void);
+ *
+ *    Load the groups and scenes from the configuration. This must be
+ *    called after the plugs have been refreshed.
+ *
+ * int orvibo_scene_group (const char *name);
+ * int orvibo_scene_members (int group, const int **members);
+ *
+ *    Return the index of the named group, or -1 if not found. Return the
+ *    number of plugs in the group, and their point indexes.
+ *
+ * int orvibo_scene_search (const char *name);
+ * int orvibo_scene_activate (int scene);
+ *
+ *    Return the index of the named scene, or -1 if not found. Queue the
+ *    commands of the scene, and return the number of plugs affected.
+ *    The caller must call orvibo_plug_flush() to send the frames.
+ *
+ * int  orvibo_scene_tokens (void);
+ * void orvibo_scene_live_config (ParserContext context, int top);
+ *
+ *    Return the number of JSON tokens needed to export the groups and
+ *    scenes, and add them to the specified configuration object.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "echttp.h"
+#include "echttp_json.h"
+#include "houselog.h"
+#include "houseconfig.h"
+
+#include "orvibo_plug.h"
+#include "orvibo_scene.h"
+
+struct SceneGroup {
+    char *name;
+    char **plugs;  // As configured.
+    int  *members; // Point indexes of the known plugs.
+    int  count;    // Number of configured plugs.
+    int  known;    // Number of members.
+};
+
+struct SceneAction {
+    char *point;
+    int state;
+    int pulse;
+};
+
+struct SceneCommand { // A compiled action.
+    int plug;
+    int state;
+    int pulse;
+};
+
+struct SceneMap {
+    char *name;
+    struct SceneAction *actions;
+    int count;
+    struct SceneCommand *commands;
+    int compiled;
+};
+
+static struct SceneGroup *Groups = 0;
+static int GroupsCount = 0;
+
+static struct SceneMap *Scenes = 0;
+static int ScenesCount = 0;
+
+static void orvibo_scene_clear (void) {
+
+    int i, j;
+
+    for (i = 0; i < GroupsCount; ++i) {
+        for (j = 0; j < Groups[i].count; ++j) free (Groups[i].plugs[j]);
+        free (Groups[i].plugs);
+        free (Groups[i].members);
+        free (Groups[i].name);
+    }
+    free (Groups);
+    Groups = 0;
+    GroupsCount = 0;
+
+    for (i = 0; i < ScenesCount; ++i) {
+        for (j = 0; j < Scenes[i].count; ++j) free (Scenes[i].actions[j].point);
+        free (Scenes[i].actions);
+        free (Scenes[i].commands);
+        free (Scenes[i].name);
+    }
+    free (Scenes);
+    Scenes = 0;
+    ScenesCount = 0;
+}
+
+static int orvibo_scene_list (const char *path, int parent, int **list) {
+
+    int array = houseconfig_array (parent, path);
+    if (array < 0) return 0;
+    int count = houseconfig_array_length (array);
+    if (count <= 0) return 0;
+    *list = calloc (count, sizeof(int));
+    if (!*list) return 0;
+    houseconfig_enumerate (array, *list, count);
+    return count;
+}
+
+// Several plugs may share the same name: all of them are members.
+//
+static int orvibo_scene_count (const char *name) {
+    int count = 0;
+    int point;
+    for (point = orvibo_plug_search (name);
+         point >= 0; point = orvibo_plug_search_next (name, point)) count += 1;
+    return count;
+}
+
+static const char *orvibo_scene_load_groups (void) {
+
+    int *list = 0;
+    int count = orvibo_scene_list (".orvibo.groups", 0, &list);
+    int i, j;
+
+    if (count <= 0) return 0;
+    Groups = calloc (count, sizeof(struct SceneGroup));
+    if (!Groups) {
+        free (list);
+        return "no more memory";
+    }
+    for (i = 0; i < count; ++i) {
+        int item = houseconfig_object (list[i], 0);
+        if (item <= 0) continue;
+        const char *name = houseconfig_string (item, ".name");
+        if (!name || !name[0]) continue;
+        if (orvibo_scene_group (name) >= 0) {
+            houselog_trace (HOUSE_WARNING, "CONFIG", "duplicate group %s", name);
+            continue;
+        }
+        struct SceneGroup *group = Groups + GroupsCount;
+
+        int *plugs = 0;
+        int plugcount = orvibo_scene_list (".plugs", item, &plugs);
+        int membercount = 0;
+        for (j = 0; j < plugcount; ++j) {
+            const char *plugname = houseconfig_string (plugs[j], 0);
+            if (plugname) membercount += orvibo_scene_count (plugname);
+        }
+        group->name = strdup (name);
+        group->plugs = calloc (plugcount + 1, sizeof(char *));
+        group->members = calloc (membercount + 1, sizeof(int));
+        if (!group->name || !group->plugs || !group->members) {
+            free (plugs);
+            free (list);
+            return "no more memory";
+        }
+        GroupsCount += 1;
+
+        for (j = 0; j < plugcount; ++j) {
+            const char *plugname = houseconfig_string (plugs[j], 0);
+            if (!plugname) continue;
+            group->plugs[group->count] = strdup (plugname);
+            if (!group->plugs[group->count]) {
+                free (plugs);
+                free (list);
+                return "no more memory";
+            }
+            group->count += 1;
+            int point = orvibo_plug_search (plugname);
+            if (point < 0) {
+                houselog_trace (HOUSE_WARNING, "CONFIG",
+                                "group %s: unknown plug %s", name, plugname);
+                continue;
+            }
+            for (; point >= 0;
+                 point = orvibo_plug_search_next (plugname, point))
+                group->members[group->known++] = point;
+        }
+        free (plugs);
+    }
+    free (list);
+    return 0;
+}
+
+static void orvibo_scene_add (struct SceneMap *scene, int plug,
+                              const struct SceneAction *action) {
+    struct SceneCommand *command = scene->commands + scene->compiled;
+    command->plug = plug;
+    command->state = action->state;
+    command->pulse = action->pulse;
+    scene->compiled += 1;
+}
+
+// Resolve the plug names and expand the groups, so that activating
+// the scene requires no lookup.
+//
+static const char *orvibo_scene_compile (struct SceneMap *scene) {
+
+    int size = 0;
+    int i, j;
+
+    for (i = 0; i < scene->count; ++i) {
+        const char *point = scene->actions[i].point;
+        int plugs = orvibo_scene_count (point);
+        if (plugs > 0) {
+            size += plugs;
+        } else {
+            int group = orvibo_scene_group (point);
+            if (group >= 0) size += Groups[group].known;
+        }
+    }
+    scene->commands = calloc (size + 1, sizeof(struct SceneCommand));
+    if (!scene->commands) return "no more memory";
+
+    for (i = 0; i < scene->count; ++i) {
+        const struct SceneAction *action = scene->actions + i;
+        int point = orvibo_plug_search (action->point);
+        if (point >= 0) {
+            for (; point >= 0;
+                 point = orvibo_plug_search_next (action->point, point))
+                orvibo_scene_add (scene, point, action);
+            continue;
+        }
+        int group = orvibo_scene_group (action->point);
+        if (group < 0) {
+            houselog_trace (HOUSE_WARNING, "CONFIG",
+                            "scene %s: unknown point %s",
+                            scene->name, action->point);
+            continue;
+        }
+        const int *members;
+        int count = orvibo_scene_members (group, &members);
+        for (j = 0; j < count; ++j)
+            orvibo_scene_add (scene, members[j], action);
+    }
+    return 0;
+}
+
+static const char *orvibo_scene_load_scenes (void) {
+
+    int *list = 0;
+    int count = orvibo_scene_list (".orvibo.scenes", 0, &list);
+    int i, j;
+
+    if (count <= 0) return 0;
+    Scenes = calloc (count, sizeof(struct SceneMap));
+    if (!Scenes) {
+        free (list);
+        return "no more memory";
+    }
+    for (i = 0; i < count; ++i) {
+        int item = houseconfig_object (list[i], 0);
+        if (item <= 0) continue;
+        const char *name = houseconfig_string (item, ".name");
+        if (!name || !name[0]) continue;
+        if (orvibo_scene_search (name) >= 0) {
+            houselog_trace (HOUSE_WARNING, "CONFIG", "duplicate scene %s", name);
+            continue;
+        }
+        struct SceneMap *scene = Scenes + ScenesCount;
+
+        int *actions = 0;
+        int actioncount = orvibo_scene_list (".actions", item, &actions);
+        scene->name = strdup (name);
+        scene->actions = calloc (actioncount + 1, sizeof(struct SceneAction));
+        if (!scene->name || !scene->actions) {
+            free (actions);
+            free (list);
+            return "no more memory";
+        }
+        ScenesCount += 1;
+
+        for (j = 0; j < actioncount; ++j) {
+            int action = houseconfig_object (actions[j], 0);
+            if (action <= 0) continue;
+            const char *point = houseconfig_string (action, ".point");
+            const char *state = houseconfig_string (action, ".state");
+            if (!point || !state) continue;
+            struct SceneAction *a = scene->actions + scene->count;
+            a->point = strdup (point);
+            if (!a->point) {
+                free (actions);
+                free (list);
+                return "no more memory";
+            }
+            a->state = (strcmp (state, "on") == 0);
+            a->pulse = houseconfig_integer (action, ".pulse");
+            if (a->pulse < 0) a->pulse = 0;
+            scene->count += 1;
+        }
+        free (actions);
+
+        const char *error = orvibo_scene_compile (scene);
+        if (error) {
+            free (list);
+            return error;
+        }
+    }
+    free (list);
+    return 0;
+}
+
+const char *orvibo_scene_refresh (void) {
+
+    orvibo_scene_clear ();
+    if (!houseconfig_active()) return 0;
+
+    const char *error = orvibo_scene_load_groups ();
+    if (!error) error = orvibo_scene_load_scenes ();
+    if (error) {
+        orvibo_scene_clear ();
+        return error;
+    }
+    if (echttp_isdebug())
+        fprintf (stderr, "loaded %d groups, %d scenes\n", GroupsCount, ScenesCount);
+    return 0;
+}
+
+int orvibo_scene_group (const char *name) {
+    int i;
+    for (i = 0; i < GroupsCount; ++i) {
+        if (strcmp (Groups[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+int orvibo_scene_members (int group, const int **members) {
+    if (group < 0 || group >= GroupsCount) return 0;
+    *members = Groups[group].members;
+    return Groups[group].known;
+}
+
+int orvibo_scene_search (const char *name) {
+    int i;
+    for (i = 0; i < ScenesCount; ++i) {
+        if (strcmp (Scenes[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+int orvibo_scene_activate (int scene) {
+
+    if (scene < 0 || scene >= ScenesCount) return 0;
+
+    int i;
+    int count = 0;
+    const struct SceneMap *s = Scenes + scene;
+    for (i = 0; i < s->compiled; ++i) {
+        const struct SceneCommand *command = s->commands + i;
+        if (orvibo_plug_set (command->plug, command->state, command->pulse) > 0)
+            count += 1;
+    }
+    houselog_event ("SCENE", s->name, "ACTIVATED", "%d PLUGS", count);
+    return count;
+}
+
+int orvibo_scene_tokens (void) {
+    int i;
+    int tokens = 2;
+    for (i = 0; i < GroupsCount; ++i) tokens += 3 + Groups[i].count;
+    for (i = 0; i < ScenesCount; ++i) tokens += 3 + (4 * Scenes[i].count);
+    return tokens;
+}
+
+void orvibo_scene_live_config (ParserContext context, int top) {
+
+    int i, j;
+
+    if (GroupsCount > 0) {
+        int groups = echttp_json_add_array (context, top, "groups");
+        for (i = 0; i < GroupsCount; ++i) {
+            int group = echttp_json_add_object (context, groups, 0);
+            echttp_json_add_string (context, group, "name", Groups[i].name);
+            int plugs = echttp_json_add_array (context, group, "plugs");
+            for (j = 0; j < Groups[i].count; ++j)
+                echttp_json_add_string (context, plugs, 0, Groups[i].plugs[j]);
+        }
+    }
+    if (ScenesCount > 0) {
+        int scenes = echttp_json_add_array (context, top, "scenes");
+        for (i = 0; i < ScenesCount; ++i) {
+            int scene = echttp_json_add_object (context, scenes, 0);
+            echttp_json_add_string (context, scene, "name", Scenes[i].name);
+            int actions = echttp_json_add_array (context, scene, "actions");
+            for (j = 0; j < Scenes[i].count; ++j) {
+                const struct SceneAction *a = Scenes[i].actions + j;
+                int action = echttp_json_add_object (context, actions, 0);
+                echttp_json_add_string (context, action, "point", a->point);
+                echttp_json_add_string (context, action, "state",
+                                        a->state ? "on" : "off");
+                if (a->pulse)
+                    echttp_json_add_integer (context, action, "pulse", a->pulse);
+            }
+        }
+    }
+}
+
@@ -0,0 +1,218 @@
+/* orvibo - A simple home web server for control of orvibo WiFi plugs
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * orvibo_snapshot.c - Persist the state of the plugs across restarts.
+ *
+ * This module maintains a memory-mapped file that holds one fixed size
+ * record per plug: MAC address, last known IP address, commanded state,
+ * pulse deadline and last reported status. A record is updated in place
+ * each time the plug changes, without any system call: the kernel writes
+ * the page back to the file, even if the service crashes.
+ *
+ * The record slot is the plug's point index, which is only stable while
+ * the service runs. The records from the previous run are copied when
+ * the file is opened, and the file is reset once they have been restored.
+ *
+ * SYNOPSYS:
+ *
+ * int orvibo_snapshot_initialize (int argc, const char **argv);
+ *
+ *    Open the snapshot file, as specified by the -orvibo-snapshot=PATH
+ *    option. There is no snapshot if the option is not present. Return
+ *    the number of records saved by the previous run.
+ *
+ * int orvibo_snapshot_restore (int index, struct OrviboSnapshot *record);
+ * void orvibo_snapshot_reset (void);
+ *
+ *    Retrieve one of the records saved by the previous run. Return 0
+ *    if index is out of range. Once all records have been restored, reset
+ *    the snapshot file: the plugs must then be saved again.
+ *
+ * void orvibo_snapshot_update (int slot, const struct OrviboSnapshot *record);
+ * void orvibo_snapshot_clear (int slot);
+ *
+ *    Save or erase the state of one plug.
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "echttp.h"
+#include "houselog.h"
+
+#include "orvibo_snapshot.h"
+
+#define ORVIBO_SNAPSHOT_MAGIC   0x4f52564930534e50ULL // "ORVI0SNP"
+#define ORVIBO_SNAPSHOT_VERSION 1
+#define ORVIBO_SNAPSHOT_CHUNK   256 // Records added when growing.
+
+struct SnapshotHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t size;   // Number of record slots in the file.
+};
+
+static int SnapshotFile = -1;
+static const char *SnapshotPath = 0;
+static struct SnapshotHeader *SnapshotMap = 0;
+static struct OrviboSnapshot *SnapshotRecords = 0;
+static int SnapshotSize = 0;
+
+static struct OrviboSnapshot *SnapshotPrevious = 0;
+static int SnapshotPreviousCount = 0;
+
+static size_t orvibo_snapshot_length (int size) {
+    return sizeof(struct SnapshotHeader) + (size * sizeof(struct OrviboSnapshot));
+}
+
+static int orvibo_snapshot_map (int size) {
+
+    size_t length = orvibo_snapshot_length (size);
+
+    if (ftruncate (SnapshotFile, length) < 0) {
+        houselog_trace (HOUSE_FAILURE, "SNAPSHOT", "cannot resize %s: %s",
+                        SnapshotPath, strerror(errno));
+        return 0;
+    }
+    void *map = mmap (0, length, PROT_READ | PROT_WRITE, MAP_SHARED, SnapshotFile, 0);
+    if (map == MAP_FAILED) {
+        houselog_trace (HOUSE_FAILURE, "SNAPSHOT", "cannot map %s: %s",
+                        SnapshotPath, strerror(errno));
+        return 0;
+    }
+    if (SnapshotMap) munmap (SnapshotMap, orvibo_snapshot_length (SnapshotSize));
+    SnapshotMap = (struct SnapshotHeader *)map;
+    SnapshotRecords = (struct OrviboSnapshot *)(SnapshotMap + 1);
+    SnapshotSize = size;
+    SnapshotMap->magic = ORVIBO_SNAPSHOT_MAGIC;
+    SnapshotMap->version = ORVIBO_SNAPSHOT_VERSION;
+    SnapshotMap->size = size;
+    return 1;
+}
+
+// Keep a copy of the records saved by the previous run, if the file
+// is valid.
+//
+static void orvibo_snapshot_load (void) {
+
+    struct stat info;
+    struct SnapshotHeader header;
+
+    if (fstat (SnapshotFile, &info) < 0) return;
+    if (info.st_size < sizeof(header)) return;
+    if (pread (SnapshotFile, &header, sizeof(header), 0) != sizeof(header)) return;
+    if (header.magic != ORVIBO_SNAPSHOT_MAGIC ||
+        header.version != ORVIBO_SNAPSHOT_VERSION ||
+        info.st_size < orvibo_snapshot_length (header.size)) {
+        houselog_trace (HOUSE_WARNING, "SNAPSHOT", "ignoring invalid file %s",
+                        SnapshotPath);
+        return;
+    }
+    if (header.size == 0) return;
+
+    size_t length = header.size * sizeof(struct OrviboSnapshot);
+    SnapshotPrevious = malloc (length);
+    if (!SnapshotPrevious) return;
+    if (pread (SnapshotFile, SnapshotPrevious, length, sizeof(header)) != length) {
+        free (SnapshotPrevious);
+        SnapshotPrevious = 0;
+        return;
+    }
+
+    // Compact the list to the slots actually used.
+    //
+    int i;
+    for (i = 0; i < header.size; ++i) {
+        if (!SnapshotPrevious[i].mac) continue;
+        SnapshotPrevious[SnapshotPreviousCount++] = SnapshotPrevious[i];
+    }
+}
+
+int orvibo_snapshot_initialize (int argc, const char **argv) {
+
+    const char *option;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (echttp_option_match ("-orvibo-snapshot=", argv[i], &option))
+            SnapshotPath = option;
+    }
+    if (!SnapshotPath) return 0;
+
+    SnapshotFile = open (SnapshotPath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (SnapshotFile < 0) {
+        houselog_trace (HOUSE_FAILURE, "SNAPSHOT", "cannot open %s: %s",
+                        SnapshotPath, strerror(errno));
+        return 0;
+    }
+    orvibo_snapshot_load ();
+    houselog_trace (HOUSE_INFO, "SNAPSHOT", "%d plugs found in %s",
+                    SnapshotPreviousCount, SnapshotPath);
+    return SnapshotPreviousCount;
+}
+
+int orvibo_snapshot_restore (int index, struct OrviboSnapshot *record) {
+    if (index < 0 || index >= SnapshotPreviousCount) return 0;
+    *record = SnapshotPrevious[index];
+    return 1;
+}
+
+void orvibo_snapshot_reset (void) {
+
+    free (SnapshotPrevious);
+    SnapshotPrevious = 0;
+    SnapshotPreviousCount = 0;
+
+    if (SnapshotFile < 0) return;
+    if (!orvibo_snapshot_map (SnapshotSize ? SnapshotSize : ORVIBO_SNAPSHOT_CHUNK)) {
+        close (SnapshotFile);
+        SnapshotFile = -1;
+        return;
+    }
+    memset (SnapshotRecords, 0, SnapshotSize * sizeof(struct OrviboSnapshot));
+}
+
+void orvibo_snapshot_update (int slot, const struct OrviboSnapshot *record) {
+
+    if (!SnapshotMap || slot < 0) return;
+    if (slot >= SnapshotSize) {
+        int size = ((slot / ORVIBO_SNAPSHOT_CHUNK) + 1) * ORVIBO_SNAPSHOT_CHUNK;
+        int old = SnapshotSize;
+        if (!orvibo_snapshot_map (size)) return;
+        memset (SnapshotRecords + old, 0,
+                (size - old) * sizeof(struct OrviboSnapshot));
+    }
+    SnapshotRecords[slot] = *record;
+}
+
+void orvibo_snapshot_clear (int slot) {
+    if (!SnapshotMap || slot < 0 || slot >= SnapshotSize) return;
+    memset (SnapshotRecords + slot, 0, sizeof(struct OrviboSnapshot));
+}
+
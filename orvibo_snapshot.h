@@ -0,0 +1,40 @@
+/* orvibo - A simple home web server for world domination through Orvibo plugs.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * orvibo_snapshot.h - Persist the state of the plugs across restarts.
+ *
+ */
+struct OrviboSnapshot {
+    uint64_t mac;        // 0 if the slot is free.
+    uint32_t address;    // IPv4 address, network order.
+    uint16_t port;       // Network order.
+    uint8_t  commanded;
+    uint8_t  status;
+    int64_t  deadline;   // Pulse end (time_t), 0 if no pulse.
+};
+
+int  orvibo_snapshot_initialize (int argc, const char **argv);
+
+int  orvibo_snapshot_restore (int index, struct OrviboSnapshot *record);
+void orvibo_snapshot_reset   (void);
+
+void orvibo_snapshot_update (int slot, const struct OrviboSnapshot *record);
+void orvibo_snapshot_clear  (int slot);
+
@@ -0,0 +1,229 @@
+/* orvibo - A simple home web server for control of orvibo WiFi plugs
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * orvibo_timer.c - A heap of deadlines with millisecond precision.
+ *
+ * This module keeps the pending deadlines in a binary min-heap, and keeps
+ * a timerfd armed for the nearest one, so that the event loop wakes up
+ * exactly when something is due. Time is measured in milliseconds from
+ * the monotonic clock. Each timer is identified by a small integer chosen
+ * by the caller. Setting a timer that is already pending moves it.
+ *
+ * SYNOPSYS:
+ *
+ * int orvibo_timer_initialize (void);
+ *
+ *    Initialize the timer heap. Return the file descriptor to listen to:
+ *    it becomes readable when the nearest deadline is due.
+ *
+ * long long orvibo_timer_now (void);
+ *
+ *    Return the current monotonic time in milliseconds.
+ *
+ * void orvibo_timer_set (int id, long long deadline);
+ * void orvibo_timer_cancel (int id);
+ *
+ *    Set or cancel the specified timer.
+ *
+ * int orvibo_timer_pending (int id);
+ *
+ *    Return 1 if the timer is set, 0 otherwise.
+ *
+ * int orvibo_timer_expired (long long now);
+ *
+ *    Remove and return the ID of a timer that expired, or -1 if none
+ *    has expired. The caller should call this function repeatedly
+ *    until it returns -1.
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/timerfd.h>
+
+#include "houselog.h"
+
+#include "orvibo_timer.h"
+
+struct TimerEntry {
+    long long deadline;
+    int id;
+};
+
+static struct TimerEntry *TimerHeap = 0;
+static int TimerCount = 0;
+static int TimerSpace = 0;
+
+static int *TimerPosition = 0; // Heap position by timer ID, -1 if not set.
+static int TimerIdSpace = 0;
+
+static int TimerFd = -1;
+static long long TimerArmed = -1;
+
+long long orvibo_timer_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Arm the timerfd for the nearest deadline, only if that changed.
+//
+static void orvibo_timer_arm (void) {
+
+    long long deadline = (TimerCount > 0) ? TimerHeap[0].deadline : -1;
+    if (deadline == TimerArmed) return;
+    TimerArmed = deadline;
+
+    struct itimerspec value;
+    memset (&value, 0, sizeof(value));
+    if (deadline >= 0) {
+        if (deadline == 0) deadline = 1; // 0 would disarm the timer.
+        value.it_value.tv_sec = deadline / 1000;
+        value.it_value.tv_nsec = (deadline % 1000) * 1000000;
+    }
+    if (timerfd_settime (TimerFd, TFD_TIMER_ABSTIME, &value, 0) < 0)
+        houselog_trace (HOUSE_FAILURE, "TIMER",
+                        "cannot arm the timer: %s", strerror(errno));
+}
+
+static void orvibo_timer_place (int position, struct TimerEntry entry) {
+    TimerHeap[position] = entry;
+    TimerPosition[entry.id] = position;
+}
+
+static void orvibo_timer_up (int position) {
+    struct TimerEntry entry = TimerHeap[position];
+    while (position > 0) {
+        int parent = (position - 1) / 2;
+        if (TimerHeap[parent].deadline <= entry.deadline) break;
+        orvibo_timer_place (position, TimerHeap[parent]);
+        position = parent;
+    }
+    orvibo_timer_place (position, entry);
+}
+
+static void orvibo_timer_down (int position) {
+    struct TimerEntry entry = TimerHeap[position];
+    for (;;) {
+        int child = 2 * position + 1;
+        if (child >= TimerCount) break;
+        if (child + 1 < TimerCount &&
+            TimerHeap[child+1].deadline < TimerHeap[child].deadline) child += 1;
+        if (entry.deadline <= TimerHeap[child].deadline) break;
+        orvibo_timer_place (position, TimerHeap[child]);
+        position = child;
+    }
+    orvibo_timer_place (position, entry);
+}
+
+static void orvibo_timer_remove (int position) {
+    TimerPosition[TimerHeap[position].id] = -1;
+    TimerCount -= 1;
+    if (position < TimerCount) {
+        int id = TimerHeap[TimerCount].id;
+        orvibo_timer_place (position, TimerHeap[TimerCount]);
+        orvibo_timer_up (position);
+        orvibo_timer_down (TimerPosition[id]);
+    }
+}
+
+static int orvibo_timer_grow (int id) {
+
+    if (id >= TimerIdSpace) {
+        int space = TimerIdSpace ? TimerIdSpace : 256;
+        while (space <= id) space *= 2;
+        int *position = realloc (TimerPosition, space * sizeof(int));
+        if (!position) return 0;
+        memset (position + TimerIdSpace, 0xff, // All -1.
+                (space - TimerIdSpace) * sizeof(int));
+        TimerPosition = position;
+        TimerIdSpace = space;
+    }
+    if (TimerCount >= TimerSpace) {
+        int space = TimerSpace ? TimerSpace * 2 : 256;
+        struct TimerEntry *heap =
+            realloc (TimerHeap, space * sizeof(struct TimerEntry));
+        if (!heap) return 0;
+        TimerHeap = heap;
+        TimerSpace = space;
+    }
+    return 1;
+}
+
+void orvibo_timer_set (int id, long long deadline) {
+
+    if (id < 0) return;
+    if (!orvibo_timer_grow (id)) {
+        houselog_trace (HOUSE_FAILURE, "TIMER", "no more memory");
+        return;
+    }
+    int position = TimerPosition[id];
+    if (position < 0) {
+        position = TimerCount++;
+        TimerHeap[position].id = id;
+    }
+    TimerHeap[position].deadline = deadline;
+    TimerPosition[id] = position;
+    orvibo_timer_up (position);
+    orvibo_timer_down (TimerPosition[id]);
+    orvibo_timer_arm ();
+}
+
+void orvibo_timer_cancel (int id) {
+    if (id < 0 || id >= TimerIdSpace) return;
+    if (TimerPosition[id] < 0) return;
+    orvibo_timer_remove (TimerPosition[id]);
+    orvibo_timer_arm ();
+}
+
+int orvibo_timer_pending (int id) {
+    if (id < 0 || id >= TimerIdSpace) return 0;
+    return TimerPosition[id] >= 0;
+}
+
+int orvibo_timer_expired (long long now) {
+
+    if (TimerCount <= 0 || TimerHeap[0].deadline > now) {
+        // Nothing more is due. Consume the timerfd expiration, if any,
+        // so that the loop does not wake up again before the next one.
+        unsigned long long count;
+        if (read (TimerFd, &count, sizeof(count)) < 0) count = 0;
+        TimerArmed = -1;
+        orvibo_timer_arm ();
+        return -1;
+    }
+    int id = TimerHeap[0].id;
+    orvibo_timer_remove (0);
+    return id;
+}
+
+int orvibo_timer_initialize (void) {
+    TimerFd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (TimerFd < 0) {
+        houselog_trace (HOUSE_FAILURE, "TIMER",
+                        "cannot create timer: %s", strerror(errno));
+        exit(1);
+    }
+    return TimerFd;
+}
+
@@ -0,0 +1,33 @@
+/* orvibo - A simple home web server for world domination through Orvibo plugs.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * orvibo_timer.h - A heap of deadlines with millisecond precision.
+ *
+ */
+int  orvibo_timer_initialize (void);
+
+long long orvibo_timer_now (void);
+
+void orvibo_timer_set     (int id, long long deadline);
+void orvibo_timer_cancel  (int id);
+int  orvibo_timer_pending (int id);
+
+int  orvibo_timer_expired (long long now);
+
@@ -0,0 +1,435 @@
+/* orviboemu - A simple emulator of a fleet of Orvibo S20 WiFi plugs.
+ *
+ * Copyright 2020, Pascal Martin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ *
+ *
+ * orviboemu.c - Emulate a fleet of Orvibo S20 WiFi plugs, for testing.
+ *
+ * SYNOPSYS:
+ *
+ * orviboemu [-plugs=N] [-address=IP] [-port=N] [-latency=MS] [-jitter=MS]
+ *           [-loss=PERCENT] [-flap=SECONDS] [-expiry=SECONDS] [-debug]
+ *
+ *    -plugs=N        Number of plugs to emulate (default: 16).
+ *    -address=IP     Local IP address to listen to (default: any).
+ *    -port=N         Local UDP port to listen to (default: 10000).
+ *    -latency=MS     Delay before each reply (default: 0).
+ *    -jitter=MS      Random variation added to the delay (default: 0).
+ *    -loss=PERCENT   Probability of losing a request or a reply (default: 0).
+ *    -flap=SECONDS   Average period between spontaneous state changes of
+ *                    each plug, as if someone pressed the button (default:
+ *                    never).
+ *    -expiry=SECONDS Lifetime of a subscription: a control request from
+ *                    a client that did not renew its subscription is
+ *                    ignored, as a real plug does (default: never).
+ *    -debug          Print every frame received and sent.
+ *
+ *    All plugs share the same UDP socket: the requests are dispatched to
+ *    the plug that matches the MAC address in the frame. A broadcast
+ *    discovery request causes every plug to reply. The MAC addresses are
+ *    AC:CF:23:XX:XX:XX, where XX:XX:XX is the plug index.
+ *
+ *    To run the orvibo service against this emulator on the same host:
+ *
+ *       orviboemu -plugs=1000 -address=127.0.0.1 &
+ *       orvibo -orvibo-port=10001 -orvibo-discovery=127.0.0.1:10000
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#define EMU_DISCOVERY 0
+#define EMU_SUBSCRIBE 1
+#define EMU_CONTROL   2
+#define EMU_STATE     3
+#define EMU_PROBE     4
+
+struct EmuPlug {
+    unsigned char mac[6];
+    int state;
+    int subscribed;
+    long long subscribedat;
+    struct sockaddr_in subscriber;
+};
+
+static struct EmuPlug *EmuPlugs = 0;
+static int EmuCount = 16;
+
+static int EmuLatency = 0;
+static int EmuJitter = 0;
+static int EmuLoss = 0;
+static int EmuFlap = 0;
+static int EmuExpiry = 0;
+static int EmuDebug = 0;
+
+static int EmuSocket = -1;
+
+// The replies are delayed according to the latency options: they are
+// kept in a heap, ordered by due time, until they must be sent.
+//
+struct EmuReply {
+    long long due;
+    int plug;
+    int kind;
+    struct sockaddr_in to;
+};
+
+static struct EmuReply *EmuHeap = 0;
+static int EmuHeapCount = 0;
+static int EmuHeapSpace = 0;
+
+static long EmuReceived = 0;
+static long EmuSent = 0;
+static long EmuLost = 0;
+static long EmuIgnored = 0;
+static long EmuFlapped = 0;
+static long EmuExpired = 0;
+
+static long long emu_now (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return ((long long)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+static int emu_lost (void) {
+    if (EmuLoss <= 0) return 0;
+    if ((random() % 100) >= EmuLoss) return 0;
+    EmuLost += 1;
+    return 1;
+}
+
+static void emu_dump (const char *label, const unsigned char *d, int l) {
+    int i;
+    printf ("%s:", label);
+    for (i = 0; i < l; ++i) printf (" %02x", d[i]);
+    printf ("\n");
+}
+
+static void emu_schedule (int plug, int kind,
+                          const struct sockaddr_in *to, long long now) {
+
+    if (emu_lost()) return;
+
+    if (EmuHeapCount >= EmuHeapSpace) {
+        int space = EmuHeapSpace ? 2 * EmuHeapSpace : 1024;
+        struct EmuReply *heap = realloc (EmuHeap, space * sizeof(*heap));
+        if (!heap) {
+            fprintf (stderr, "no more memory\n");
+            exit(1);
+        }
+        EmuHeap = heap;
+        EmuHeapSpace = space;
+    }
+    struct EmuReply reply;
+    reply.due = now + EmuLatency;
+    if (EmuJitter > 0) reply.due += random() % (EmuJitter + 1);
+    reply.plug = plug;
+    reply.kind = kind;
+    reply.to = *to;
+
+    int i = EmuHeapCount++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (EmuHeap[parent].due <= reply.due) break;
+        EmuHeap[i] = EmuHeap[parent];
+        i = parent;
+    }
+    EmuHeap[i] = reply;
+}
+
+static void emu_pop (void) {
+
+    struct EmuReply last = EmuHeap[--EmuHeapCount];
+    int i = 0;
+    for (;;) {
+        int child = (2 * i) + 1;
+        if (child >= EmuHeapCount) break;
+        if (child + 1 < EmuHeapCount &&
+            EmuHeap[child+1].due < EmuHeap[child].due) child += 1;
+        if (last.due <= EmuHeap[child].due) break;
+        EmuHeap[i] = EmuHeap[child];
+        i = child;
+    }
+    if (EmuHeapCount > 0) EmuHeap[i] = last;
+}
+
+static void emu_send (const struct EmuReply *reply) {
+
+    static const unsigned char header[] = {0x68, 0x64, 0x00};
+    static const char *code[] = {"qa", "cl", "dc", "sf", "qg"};
+    static const int length[] = {0x2a, 0x18, 0x17, 0x17, 0x2a};
+
+    const struct EmuPlug *p = EmuPlugs + reply->plug;
+    unsigned char frame[64];
+    int i;
+
+    memset (frame, 0, sizeof(frame));
+    memcpy (frame, header, sizeof(header));
+    frame[3] = length[reply->kind];
+    memcpy (frame + 4, code[reply->kind], 2);
+
+    switch (reply->kind) {
+        case EMU_DISCOVERY:
+        case EMU_PROBE:
+            memcpy (frame + 7, p->mac, 6);
+            memset (frame + 13, 0x20, 6);
+            for (i = 0; i < 6; ++i) frame[19+i] = p->mac[5-i];
+            memset (frame + 25, 0x20, 6);
+            memcpy (frame + 31, "SOC002", 6);
+            frame[41] = p->state;
+            break;
+        case EMU_SUBSCRIBE:
+            memcpy (frame + 6, p->mac, 6);
+            memset (frame + 12, 0x20, 6);
+            frame[23] = p->state;
+            break;
+        default:
+            memcpy (frame + 6, p->mac, 6);
+            memset (frame + 12, 0x20, 6);
+            frame[22] = p->state;
+            break;
+    }
+    int sent = sendto (EmuSocket, frame, frame[3], 0,
+                       (struct sockaddr *)(&reply->to), sizeof(reply->to));
+    if (sent < 0) {
+        printf ("** sendto() error: %s\n", strerror(errno));
+        return;
+    }
+    EmuSent += 1;
+    if (EmuDebug) emu_dump ("sent", frame, frame[3]);
+}
+
+static int emu_search (const unsigned char *mac) {
+    if (mac[0] != 0xac || mac[1] != 0xcf || mac[2] != 0x23) return -1;
+    int index = (mac[3] << 16) + (mac[4] << 8) + mac[5];
+    if (index >= EmuCount) return -1;
+    return index;
+}
+
+static void emu_receive (long long now) {
+
+    unsigned char data[128];
+    struct sockaddr_in addr;
+
+    for (;;) {
+        socklen_t addrlen = sizeof(addr);
+        int size = recvfrom (EmuSocket, data, sizeof(data), MSG_DONTWAIT,
+                             (struct sockaddr *)(&addr), &addrlen);
+        if (size <= 0) return;
+
+        EmuReceived += 1;
+        if (EmuDebug) emu_dump ("received", data, size);
+        if (emu_lost()) continue;
+
+        if (size < 6 || data[0] != 0x68 || data[1] != 0x64 || data[3] != size) {
+            EmuIgnored += 1;
+            continue;
+        }
+        if (data[4] == 'q' && data[5] == 'a' && size == 6) {
+            // Broadcast discovery: all plugs reply.
+            int i;
+            for (i = 0; i < EmuCount; ++i)
+                emu_schedule (i, EMU_DISCOVERY, &addr, now);
+
+        } else if (data[4] == 'q' && data[5] == 'g' && size == 0x12) {
+            int plug = emu_search (data + 6);
+            if (plug >= 0) emu_schedule (plug, EMU_PROBE, &addr, now);
+            else EmuIgnored += 1;
+
+        } else if (data[4] == 'c' && data[5] == 'l' && size == 0x1e) {
+            int plug = emu_search (data + 6);
+            if (plug < 0) {
+                EmuIgnored += 1;
+                continue;
+            }
+            EmuPlugs[plug].subscribed = 1;
+            EmuPlugs[plug].subscribedat = now;
+            EmuPlugs[plug].subscriber = addr;
+            emu_schedule (plug, EMU_SUBSCRIBE, &addr, now);
+
+        } else if (data[4] == 'd' && data[5] == 'c' && size == 0x17) {
+            int plug = emu_search (data + 6);
+            if (plug >= 0 && EmuPlugs[plug].subscribed && EmuExpiry > 0 &&
+                now >= EmuPlugs[plug].subscribedat + (EmuExpiry * 1000LL)) {
+                EmuPlugs[plug].subscribed = 0;
+                EmuExpired += 1;
+            }
+            if (plug < 0 || !EmuPlugs[plug].subscribed) {
+                EmuIgnored += 1; // A real plug ignores unsubscribed clients.
+                continue;
+            }
+            EmuPlugs[plug].state = data[22] ? 1 : 0;
+            emu_schedule (plug, EMU_CONTROL, &addr, now);
+            emu_schedule (plug, EMU_STATE, &addr, now);
+        } else {
+            EmuIgnored += 1;
+        }
+    }
+}
+
+// Spontaneous state changes are spread randomly over the whole fleet,
+// so that each plug changes state once per flap period on average.
+//
+static long long emu_flap (long long now, long long next) {
+
+    if (EmuFlap <= 0) return 0;
+    if (next > now) return next;
+
+    int plug = random() % EmuCount;
+    struct EmuPlug *p = EmuPlugs + plug;
+    p->state = !p->state;
+    EmuFlapped += 1;
+    if (p->subscribed) emu_schedule (plug, EMU_STATE, &(p->subscriber), now);
+
+    long long period = (2000LL * EmuFlap) / EmuCount;
+    return now + (period ? (random() % period) : 0);
+}
+
+static void emu_socket (const char *address, int port) {
+
+    struct sockaddr_in local;
+
+    memset (&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr.s_addr = INADDR_ANY;
+    if (address && !inet_aton (address, &local.sin_addr)) {
+        fprintf (stderr, "invalid address %s\n", address);
+        exit(1);
+    }
+
+    EmuSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (EmuSocket < 0) {
+        printf ("cannot open UDP socket: %s\n", strerror(errno));
+        exit(1);
+    }
+    int value = 1;
+    setsockopt(EmuSocket, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+    value = 1024 * 1024;
+    setsockopt(EmuSocket, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value));
+    setsockopt(EmuSocket, SOL_SOCKET, SO_RCVBUF, &value, sizeof(value));
+
+    if (bind(EmuSocket, (struct sockaddr *)(&local), sizeof(local)) < 0) {
+        printf ("cannot bind to UDP port %d: %s\n", port, strerror(errno));
+        exit(1);
+    }
+    printf ("Emulating %d plugs on %s:%d\n",
+            EmuCount, address?address:"*", port);
+    fflush (stdout);
+}
+
+static int emu_option (const char *name, const char *arg, const char **value) {
+    int length = strlen(name);
+    if (strncmp (name, arg, length)) return 0;
+    *value = arg + length;
+    return 1;
+}
+
+int main (int argc, char **argv) {
+
+    const char *address = 0;
+    const char *value;
+    int port = 10000;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (emu_option ("-plugs=", argv[i], &value)) {
+            EmuCount = atoi(value);
+        } else if (emu_option ("-address=", argv[i], &value)) {
+            address = value;
+        } else if (emu_option ("-port=", argv[i], &value)) {
+            port = atoi(value);
+        } else if (emu_option ("-latency=", argv[i], &value)) {
+            EmuLatency = atoi(value);
+        } else if (emu_option ("-jitter=", argv[i], &value)) {
+            EmuJitter = atoi(value);
+        } else if (emu_option ("-loss=", argv[i], &value)) {
+            EmuLoss = atoi(value);
+        } else if (emu_option ("-flap=", argv[i], &value)) {
+            EmuFlap = atoi(value);
+        } else if (emu_option ("-expiry=", argv[i], &value)) {
+            EmuExpiry = atoi(value);
+        } else if (strcmp (argv[i], "-debug") == 0) {
+            EmuDebug = 1;
+        } else {
+            fprintf (stderr, "Invalid option %s\n", argv[i]);
+            exit(1);
+        }
+    }
+    if (EmuCount <= 0 || EmuCount > 0x1000000) {
+        fprintf (stderr, "Invalid number of plugs: %d\n", EmuCount);
+        exit(1);
+    }
+
+    srandom (time(0) ^ getpid());
+    EmuPlugs = calloc (EmuCount, sizeof(struct EmuPlug));
+    if (!EmuPlugs) {
+        fprintf (stderr, "no more memory\n");
+        exit(1);
+    }
+    for (i = 0; i < EmuCount; ++i) {
+        EmuPlugs[i].mac[0] = 0xac;
+        EmuPlugs[i].mac[1] = 0xcf;
+        EmuPlugs[i].mac[2] = 0x23;
+        EmuPlugs[i].mac[3] = (i >> 16) & 0xff;
+        EmuPlugs[i].mac[4] = (i >> 8) & 0xff;
+        EmuPlugs[i].mac[5] = i & 0xff;
+    }
+    emu_socket (address, port);
+
+    long long nextflap = 0;
+    long long nextreport = emu_now() + 10000;
+
+    for (;;) {
+        long long now = emu_now();
+
+        while (EmuHeapCount > 0 && EmuHeap[0].due <= now) {
+            emu_send (EmuHeap);
+            emu_pop ();
+        }
+        nextflap = emu_flap (now, nextflap);
+
+        if (now >= nextreport) {
+            printf ("received %ld, sent %ld, lost %ld, ignored %ld, flapped %ld, expired %ld\n",
+                    EmuReceived, EmuSent, EmuLost, EmuIgnored, EmuFlapped, EmuExpired);
+            fflush (stdout);
+            nextreport = now + 10000;
+        }
+
+        long long wakeup = nextreport;
+        if (EmuHeapCount > 0 && EmuHeap[0].due < wakeup) wakeup = EmuHeap[0].due;
+        if (nextflap && nextflap < wakeup) wakeup = nextflap;
+
+        struct pollfd poller;
+        poller.fd = EmuSocket;
+        poller.events = POLLIN;
+        int timeout = (wakeup > now) ? (int)(wakeup - now) : 0;
+        if (poll (&poller, 1, timeout) > 0) emu_receive (emu_now());
+    }
+    return 0;
+}
+